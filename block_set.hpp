@@ -0,0 +1,404 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * block_set.hpp
+ *
+ * A set implemented as a splay tree whose nodes each hold a small, sorted
+ * block of keys, rather than a single key. For small keys like ints, an
+ * ordinary splaytree::set spends most of each node on pointers, and every
+ * level of a search is another dependent cache miss. Packing a cache line's
+ * worth of keys into each node gives us a much better ratio of keys to
+ * pointers, and a much shallower tree.
+ *
+ * The trick that lets us reuse splaytree's node class unchanged is to treat
+ * each block as an interval: a key compares less than a block if it is less
+ * than the block's first key, and greater than a block if it is greater than
+ * the block's last key. Otherwise, the key belongs in that block. Searching
+ * the tree for a key with that comparison therefore finds the block which
+ * contains (or should contain) the key, and splays it to the root, just like
+ * a regular splaytree does with single elements. Within a block, we find a
+ * key's position by counting the keys less than it, without branches, which
+ * compilers can vectorize.
+ *
+ * Since blocks are copied around with memmove-like operations, the key type
+ * must be trivially copyable.
+ */
+
+#ifndef BLOCK_SET_HPP
+#define BLOCK_SET_HPP
+
+#include "splaytree.hpp"
+
+#include <cassert>
+#include <cstddef>
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace splaytree {
+
+namespace detail {
+
+/* By default, fill one 64-byte cache line with keys, but hold at least four
+ * keys per block. */
+template <typename T>
+struct default_block_size
+    : std::integral_constant<size_t, sizeof(T) * 4 < 64 ? 64 / sizeof(T) : 4> { };
+
+/* The value stored in each node of a block_set: up to N keys, sorted. */
+template <typename T, size_t N>
+struct key_block {
+    static_assert(N >= 2, "a key_block must be able to split in two");
+
+    /* Value-initialize all keys, so that rank() can safely read the unused
+     * slots past the end. */
+    T keys[N] {};
+    size_t count = 0;
+
+    const T& front () const { return keys[0]; }
+    const T& back () const { return keys[count - 1]; }
+
+    bool full () const { return N == count; }
+
+    /* Return the number of keys in this block that are less than key, i.e.,
+     * the position of key's lower bound. Deliberately branch-free: we
+     * compare against every slot and mask off the unused ones. */
+    template <typename Compare>
+    size_t rank (const T& key, const Compare& comp) const {
+        size_t n = 0;
+        for (size_t i = 0; i < N; ++i) {
+            n += (i < count) & comp(keys[i], key);
+        }
+        return n;
+    }
+
+    void insert (size_t pos, const T& key) {
+        assert(!full() && pos <= count);
+        std::copy_backward(keys + pos, keys + count, keys + count + 1);
+        keys[pos] = key;
+        ++count;
+    }
+
+    void erase (size_t pos) {
+        assert(pos < count);
+        std::copy(keys + pos + 1, keys + count, keys + pos);
+        --count;
+    }
+
+    /* Move the upper half of our keys into other, which must be empty. */
+    void split (key_block& other) {
+        assert(!other.count);
+        auto half = count / 2;
+        std::copy(keys + half, keys + count, other.keys);
+        other.count = count - half;
+        count = half;
+    }
+};
+
+/* Compares keys against blocks, treating each block as the closed interval
+ * between its first and last keys. This is what lets node::search() find a
+ * key's block. */
+template <typename T, size_t N, typename Compare>
+struct key_block_compare {
+    using block_type = key_block<T, N>;
+
+    bool operator() (const T& lhs, const block_type& rhs) const {
+        return comp(lhs, rhs.front());
+    }
+
+    bool operator() (const block_type& lhs, const T& rhs) const {
+        return comp(lhs.back(), rhs);
+    }
+
+    Compare comp;
+};
+
+template <typename T, size_t N>
+struct block_iterator : std::iterator<std::forward_iterator_tag, const T> {
+    using node_type = node<key_block<T, N>>;
+
+    explicit block_iterator (node_type* node = nullptr, size_t index = 0)
+            : m_node(node), m_index(index) { }
+
+    bool operator== (const block_iterator& other) const {
+        return m_node == other.m_node && m_index == other.m_index;
+    }
+
+    bool operator!= (const block_iterator& other) const {
+        return !(*this == other);
+    }
+
+    const T& operator* () const { return m_node->value().keys[m_index]; }
+    const T* operator-> () const { return &**this; }
+
+    block_iterator& operator++ () {
+        if (++m_index == m_node->value().count) {
+            m_node = node_type::increment(m_node);
+            m_index = 0;
+        }
+        return *this;
+    }
+
+    /* Postfix */
+    block_iterator operator++ (int) {
+        auto ret = *this;
+        ++*this;
+        return ret;
+    }
+
+    node_type* m_node;
+    size_t m_index;
+};
+
+} // namespace detail
+
+//////////////////////////////////////////////////////////////////////////////
+
+/* A std::set-like container of trivially copyable keys, implemented as a
+ * splay tree of key blocks. Only a subset of std::set's interface is
+ * provided. As with splaytree::set, all iterators are const. */
+template <typename T, typename Compare = std::less<T>,
+          size_t BlockSize = detail::default_block_size<T>::value>
+class block_set {
+public:
+    static_assert(std::is_trivially_copyable<T>::value,
+            "block_set requires a trivially copyable key type");
+
+    using key_type = T;
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    using reference = value_type&;
+    using const_reference = const value_type&;
+
+    using block_type = detail::key_block<T, BlockSize>;
+    using node_type = detail::node<block_type>;
+
+    using iterator = detail::block_iterator<T, BlockSize>;
+    using const_iterator = iterator;
+
+    using difference_type = ptrdiff_t;
+    using size_type = size_t;
+
+    explicit block_set (const key_compare& comp = key_compare())
+            : m_comp { comp } { }
+
+    block_set (const block_set& other) : block_set(other.begin(), other.end(), other.key_comp()) { }
+
+    block_set (block_set&& other) : block_set() {
+        swap(other);
+    }
+
+    template <typename Iter>
+    block_set (Iter first, Iter last, const key_compare& comp = key_compare())
+            : block_set(comp) {
+        insert(first, last);
+    }
+
+    block_set (std::initializer_list<value_type> ilist,
+               const key_compare& comp = key_compare())
+            : block_set(ilist.begin(), ilist.end(), comp) { }
+
+    ~block_set () {
+        delete m_root;
+    }
+
+    block_set& operator= (block_set other) {
+        swap(other);
+        return *this;
+    }
+
+    void swap (block_set& other) {
+        using std::swap;
+        swap(m_comp, other.m_comp);
+        swap(m_size, other.m_size);
+        swap(m_root, other.m_root);
+    }
+
+    friend void swap (block_set& lhs, block_set& rhs) {
+        lhs.swap(rhs);
+    }
+
+    iterator begin () const { return iterator(node_type::minimum(m_root)); }
+    iterator cbegin () const { return begin(); }
+
+    iterator end () const { return iterator(); }
+    iterator cend () const { return end(); }
+
+    size_type size () const { return m_size; }
+
+    bool empty () const {
+        assert(!!m_size == !!m_root);
+        return !m_root;
+    }
+
+    key_compare key_comp () const { return m_comp.comp; }
+    value_compare value_comp () const { return m_comp.comp; }
+
+    void clear () {
+        delete m_root;
+        m_root = nullptr;
+        m_size = 0;
+    }
+
+    std::pair<iterator, bool> insert (const value_type& key) {
+        if (!m_root) {
+            m_root = new node_type();
+            m_root->value().insert(0, key);
+            ++m_size;
+            return std::make_pair(iterator(m_root), true);
+        }
+
+        /* After this search, the root block either contains key's position,
+         * or is key's predecessor or successor block. In every case, key
+         * may be inserted into the root block. */
+        m_root = node_type::search(m_root, key, m_comp);
+
+        auto pos = m_root->value().rank(key, m_comp.comp);
+        if (found(m_root, pos, key)) {
+            return std::make_pair(iterator(m_root, pos), false);
+        }
+
+        auto s = m_root;
+        if (s->value().full()) {
+            /* Split the root block, and make the upper half the root of our
+             * right subtree. */
+            auto upper = new node_type();
+            s->value().split(upper->value());
+            upper->attach_right(s->detach_right());
+            s->attach_right(upper);
+
+            if (pos > s->value().count) {
+                pos -= s->value().count;
+                s = upper;
+            }
+        }
+
+        s->value().insert(pos, key);
+        ++m_size;
+        return std::make_pair(iterator(s, pos), true);
+    }
+
+    iterator insert (const_iterator, const value_type& key) {
+        return insert(key).first;
+    }
+
+    template <typename Iter>
+    void insert (Iter first, Iter last) {
+        while (first != last) {
+            insert(*first++);
+        }
+    }
+
+    void insert (std::initializer_list<value_type> ilist) {
+        insert(ilist.begin(), ilist.end());
+    }
+
+    size_type erase (const key_type& key) {
+        auto it = find(key);
+        if (end() == it) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    iterator erase (const_iterator pos) {
+        assert(pos.m_node);
+
+        auto next = pos;
+        ++next;
+
+        auto s = pos.m_node;
+        s->value().erase(pos.m_index);
+        --m_size;
+
+        if (!s->value().count) {
+            /* Don't leave empty blocks in the tree. */
+            m_root = node_type::erase(s);
+        }
+        else if (next.m_node == s) {
+            /* The following keys in this block moved down by one. */
+            next.m_index = pos.m_index;
+        }
+
+        return next;
+    }
+
+    iterator erase (const_iterator first, const_iterator last) {
+        /* Erasing shifts keys within a block, so iterators after first in
+         * the same block are invalidated. Count instead. */
+        auto n = std::distance(first, last);
+        while (n--) {
+            first = erase(first);
+        }
+        return first;
+    }
+
+    /* Return an iterator to the given key, or end() if it is not found. */
+    iterator find (const key_type& key) {
+        if (!m_root) {
+            return end();
+        }
+
+        m_root = node_type::search(m_root, key, m_comp);
+
+        auto pos = m_root->value().rank(key, m_comp.comp);
+        return found(m_root, pos, key) ? iterator(m_root, pos) : end();
+    }
+
+    size_type count (const key_type& key) {
+        return end() != find(key);
+    }
+
+    /* Return an iterator to the smallest key greater than or equal to the
+     * given key, or end() if there is none. */
+    iterator lower_bound (const key_type& key) {
+        if (!m_root) {
+            return end();
+        }
+
+        m_root = node_type::search(m_root, key, m_comp);
+
+        auto pos = m_root->value().rank(key, m_comp.comp);
+        if (pos < m_root->value().count) {
+            return iterator(m_root, pos);
+        }
+        return iterator(node_type::increment(m_root));
+    }
+
+    /* Return an iterator to the smallest key greater than the given key, or
+     * end() if there is none. */
+    iterator upper_bound (const key_type& key) {
+        auto it = lower_bound(key);
+        if (end() != it && !m_comp.comp(key, *it)) {
+            ++it;
+        }
+        return it;
+    }
+
+private:
+    /* Return true if the key at position pos of s's block is equivalent to
+     * key. */
+    bool found (node_type* s, size_t pos, const key_type& key) const {
+        auto& block = s->value();
+        return pos < block.count && !m_comp.comp(key, block.keys[pos]);
+    }
+
+    detail::key_block_compare<T, BlockSize, Compare> m_comp;
+    size_type m_size = 0;
+    node_type* m_root = nullptr;
+};
+
+} // namespace splaytree
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * bloom_filter.hpp
+ *
+ * A counting Bloom filter of strings. It answers "might this string have
+ * been inserted?" with either "no", which is always right, or "maybe",
+ * which is wrong a few percent of the time. That is just what a lookup that
+ * usually misses wants in front of it: a miss costs a hash and a few loads
+ * from one small array, rather than a search.
+ *
+ * Each string is hashed to a few slots in a table of counters. Inserting it
+ * increments them, erasing it decrements them, and a string whose slots are
+ * all nonzero may be present. The counters are bytes. One which overflows
+ * sticks at its maximum, and is never decremented again, since we can no
+ * longer tell how many strings it counts: such a slot just always says
+ * "maybe", which costs some accuracy but never gives a wrong "no".
+ *
+ * The table does not grow by itself, since it can't rehash strings it
+ * doesn't have. When size() passes capacity(), false positives become more
+ * common, and the owner should reset() it larger and insert everything
+ * again.
+ */
+
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include <functional>
+#include <limits>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class counting_bloom_filter {
+public:
+    /* With eight counters per string and four probes, about 2.4% of
+     * lookups for strings which are absent say "maybe". */
+    static constexpr size_t slots_per_key = 8;
+    static constexpr size_t probes = 4;
+
+    explicit counting_bloom_filter (size_t expected_keys = 0) {
+        reset(expected_keys);
+    }
+
+    /* Empty the filter, and size it for the given number of strings. */
+    void reset (size_t expected_keys) {
+        size_t slots = 64;
+        while (slots < expected_keys * slots_per_key) {
+            slots *= 2;
+        }
+        m_counters.assign(slots, 0);
+        m_size = 0;
+    }
+
+    void insert (std::string_view key) {
+        probe(key, [] (std::uint8_t& counter) {
+            if (counter != saturated) {
+                ++counter;
+            }
+        });
+        ++m_size;
+    }
+
+    /* Erase one copy of key, which must have been inserted. */
+    void erase (std::string_view key) {
+        probe(key, [] (std::uint8_t& counter) {
+            if (counter != saturated) {
+                --counter;
+            }
+        });
+        --m_size;
+    }
+
+    /* False only if key is definitely not in the filter. */
+    bool may_contain (std::string_view key) const {
+        auto h = hash(key);
+        const auto mask = m_counters.size() - 1;
+        for (size_t i = 0; i < probes; ++i) {
+            if (!m_counters[(h.first + i * h.second) & mask]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* The number of strings inserted and not erased since the last
+     * reset(), counting duplicates. */
+    size_t size () const { return m_size; }
+
+    /* The number of strings the filter was sized for. */
+    size_t capacity () const { return m_counters.size() / slots_per_key; }
+
+private:
+    static constexpr std::uint8_t saturated = std::numeric_limits<std::uint8_t>::max();
+
+    /* Double hashing: the probes are h1, h1 + h2, h1 + 2*h2, and so on, with
+     * h2 odd, so they land on distinct slots of our power-of-two table. */
+    static std::pair<size_t, size_t> hash (std::string_view key) {
+        std::uint64_t h = std::hash<std::string_view>()(key);
+        auto h2 = (h * 0x9e3779b97f4a7c15ull) >> 32;
+        return std::make_pair(static_cast<size_t>(h), static_cast<size_t>(h2 | 1));
+    }
+
+    template <typename F>
+    void probe (std::string_view key, F f) {
+        auto h = hash(key);
+        const auto mask = m_counters.size() - 1;
+        for (size_t i = 0; i < probes; ++i) {
+            f(m_counters[(h.first + i * h.second) & mask]);
+        }
+    }
+
+    std::vector<std::uint8_t> m_counters;
+    size_t m_size = 0;
+};
+
+#endif
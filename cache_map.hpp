@@ -0,0 +1,322 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * cache_map.hpp
+ *
+ * A capacity-bounded map for use as a cache. A splaytree already keeps
+ * recently accessed elements near the root, but it never forgets anything,
+ * so a splaytree::map used as a cache grows without bound. cache_map wraps a
+ * splaytree map whose nodes are also threaded onto an intrusive, doubly
+ * linked recency list: every lookup or insertion moves its element to the
+ * front of the list, and when the cache is over capacity, elements are
+ * evicted from the back. Keeping the list inside the nodes means recency
+ * tracking costs no allocations.
+ *
+ * Capacity is measured by a Weigher, which assigns each element a weight
+ * when it is inserted. The default weighs every element as 1, so the
+ * capacity is a maximum number of elements; a Weigher which estimates each
+ * element's memory footprint turns the capacity into a byte budget. An
+ * element is weighed again whenever it is assigned through operator[]. If
+ * it changes some other way, say through an iterator, call reweigh().
+ */
+
+#ifndef CACHE_MAP_HPP
+#define CACHE_MAP_HPP
+
+#include "splaytree.hpp"
+
+#include <cassert>
+#include <cstddef>
+
+#include <functional>
+#include <utility>
+
+namespace splaytree {
+
+namespace detail {
+
+/* Auxiliary node data for cache_map: links in the recency list, which runs
+ * from the most to the least recently used element, and the element's
+ * weight. */
+struct lru_aux {
+    lru_aux* m_prev = nullptr;
+    lru_aux* m_next = nullptr;
+    size_t m_weight = 0;
+};
+
+/* As far as the splaytree is concerned, a cache_map's tree behaves exactly
+ * like an ordinary one, so derive from splay_access_tag to get the same
+ * behavior. */
+struct lru_access_tag : splay_access_tag {
+    using node_aux = lru_aux;
+};
+
+} // namespace detail
+
+/* The default cache_map Weigher, which makes the capacity a count of
+ * elements. */
+struct unit_weigher {
+    template <typename Value>
+    size_t operator() (const Value&) const {
+        return 1;
+    }
+};
+
+template <typename Key, typename T, typename Compare = std::less<Key>,
+          typename Weigher = unit_weigher>
+class cache_map {
+public:
+    using tree_type = splaytree<detail::map_base<Key, T, Compare,
+          detail::insert_unique_tag, detail::lru_access_tag>>;
+
+    using key_type = typename tree_type::key_type;
+    using mapped_type = typename tree_type::mapped_type;
+    using value_type = typename tree_type::value_type;
+    using key_compare = typename tree_type::key_compare;
+
+    using iterator = typename tree_type::iterator;
+    using const_iterator = typename tree_type::const_iterator;
+
+    using size_type = size_t;
+
+    /* Called with each element just before it is evicted. */
+    using eviction_callback = std::function<void (value_type&)>;
+
+    explicit cache_map (size_type capacity, const Weigher& weigher = Weigher(),
+                        const key_compare& comp = key_compare())
+            : m_tree(comp)
+            , m_weigher(weigher)
+            , m_capacity(capacity) {
+        m_list.m_prev = m_list.m_next = &m_list;
+    }
+
+    /* The recency list's ends point back at m_list, so cache_maps can
+     * neither be copied nor moved. */
+    cache_map (const cache_map&) = delete;
+    cache_map& operator= (const cache_map&) = delete;
+
+    /* Iteration is in key order, and does not count as access. */
+    iterator begin () { return m_tree.begin(); }
+    const_iterator begin () const { return m_tree.begin(); }
+    iterator end () { return m_tree.end(); }
+    const_iterator end () const { return m_tree.end(); }
+
+    size_type size () const { return m_tree.size(); }
+    bool empty () const { return m_tree.empty(); }
+
+    /* The total weight of all elements, which is at most capacity(), unless
+     * a single element outweighs the whole capacity. */
+    size_type weight () const { return m_weight; }
+
+    size_type capacity () const { return m_capacity; }
+
+    /* Change the capacity, evicting elements if necessary. */
+    void set_capacity (size_type capacity) {
+        m_capacity = capacity;
+        evict(nullptr);
+    }
+
+    void set_eviction_callback (eviction_callback callback) {
+        m_on_evict = std::move(callback);
+    }
+
+    /* Look up a key, counting a hit or a miss. A hit makes the element the
+     * most recently used. */
+    iterator find (const key_type& key) {
+        auto it = m_tree.find(key);
+        if (end() == it) {
+            ++m_misses;
+        }
+        else {
+            ++m_hits;
+            touch(it.m_node);
+        }
+        return it;
+    }
+
+    /* Insert an element unless its key is already present, and make the
+     * element with that key the most recently used. Inserting may evict
+     * other elements, but never the one just inserted. The element is
+     * weighed here, and only again by operator[] or reweigh(). */
+    std::pair<iterator, bool> insert (const value_type& value) {
+        return inserted(m_tree.insert(value));
+    }
+
+    std::pair<iterator, bool> insert (value_type&& value) {
+        return inserted(m_tree.insert(std::move(value)));
+    }
+
+    /* What operator[] returns: a stand-in for a reference to the mapped
+     * value. Assigning through it reweighs the element afterwards, which
+     * may evict others, so that cache[key] = value is weighed by the value
+     * actually stored, rather than a default-constructed one. Otherwise it
+     * converts to a mapped_type&. */
+    class mapped_reference {
+    public:
+        mapped_reference& operator= (const mapped_type& value) {
+            m_it->second = value;
+            m_cache.reweigh(m_it);
+            return *this;
+        }
+
+        mapped_reference& operator= (mapped_type&& value) {
+            m_it->second = std::move(value);
+            m_cache.reweigh(m_it);
+            return *this;
+        }
+
+        operator mapped_type& () const { return m_it.m_node->value().second; }
+
+        /* Changes made through this reference are not weighed. */
+        mapped_type& get () const { return m_it.m_node->value().second; }
+
+    private:
+        friend class cache_map;
+
+        mapped_reference (cache_map& cache, iterator it) : m_cache(cache), m_it(it) { }
+
+        cache_map& m_cache;
+        iterator m_it;
+    };
+
+    /* Get a reference to the element at the given key, inserting a default
+     * value if it does not already exist. Counts a hit or a miss. */
+    mapped_reference operator[] (const key_type& key) {
+        auto it = find(key);
+        if (end() == it) {
+            it = insert(std::make_pair(key, mapped_type())).first;
+        }
+        return mapped_reference(*this, it);
+    }
+
+    /* Weigh an element again, after its value has changed. If it got
+     * heavier, other elements may be evicted, but never this one. Does not
+     * count as access. */
+    void reweigh (const_iterator pos) {
+        auto s = pos.m_node;
+        m_weight -= s->m_weight;
+        s->m_weight = m_weigher(s->value());
+        m_weight += s->m_weight;
+        evict(s);
+    }
+
+    size_type erase (const key_type& key) {
+        auto it = m_tree.find(key);
+        if (end() == it) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    iterator erase (const_iterator pos) {
+        unlink(pos.m_node);
+        return m_tree.erase(pos);
+    }
+
+    /* Remove every element, without calling the eviction callback. */
+    void clear () {
+        m_tree.clear();
+        m_list.m_prev = m_list.m_next = &m_list;
+        m_weight = 0;
+    }
+
+    /* Statistics since construction, or the last reset_stats(). */
+    size_t hits () const { return m_hits; }
+    size_t misses () const { return m_misses; }
+    size_t evictions () const { return m_evictions; }
+
+    void reset_stats () {
+        m_hits = m_misses = m_evictions = 0;
+    }
+
+private:
+    using node_type = typename tree_type::node_type;
+
+    static node_type* to_node (detail::lru_aux* aux) {
+        return static_cast<node_type*>(aux);
+    }
+
+    std::pair<iterator, bool> inserted (std::pair<iterator, bool> result) {
+        auto s = result.first.m_node;
+        if (result.second) {
+            s->m_weight = m_weigher(s->value());
+            m_weight += s->m_weight;
+            push_front(s);
+            evict(s);
+        }
+        else {
+            touch(s);
+        }
+        return result;
+    }
+
+    /* Evict least recently used elements until we are within capacity,
+     * sparing keep. */
+    void evict (detail::lru_aux* keep) {
+        while (m_weight > m_capacity && m_list.m_prev != &m_list) {
+            auto victim = m_list.m_prev;
+            if (victim == keep) {
+                break;
+            }
+
+            auto s = to_node(victim);
+            if (m_on_evict) {
+                m_on_evict(s->value());
+            }
+            unlink(s);
+            m_tree.erase(const_iterator(s));
+            ++m_evictions;
+        }
+    }
+
+    /* Make aux the most recently used element. */
+    void touch (detail::lru_aux* aux) {
+        if (m_list.m_next != aux) {
+            remove(aux);
+            push_front(aux);
+        }
+    }
+
+    /* Take an element which is about to be erased off the list. */
+    void unlink (detail::lru_aux* aux) {
+        remove(aux);
+        m_weight -= aux->m_weight;
+    }
+
+    /* m_list is the sentinel of a circular list: m_list.m_next is the most
+     * recently used element, and m_list.m_prev the least. */
+    void push_front (detail::lru_aux* aux) {
+        aux->m_next = m_list.m_next;
+        aux->m_prev = &m_list;
+        m_list.m_next->m_prev = aux;
+        m_list.m_next = aux;
+    }
+
+    void remove (detail::lru_aux* aux) {
+        aux->m_prev->m_next = aux->m_next;
+        aux->m_next->m_prev = aux->m_prev;
+        aux->m_prev = aux->m_next = nullptr;
+    }
+
+    tree_type m_tree;
+    Weigher m_weigher;
+
+    size_type m_capacity;
+    size_type m_weight = 0;
+
+    detail::lru_aux m_list;
+    eviction_callback m_on_evict;
+
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+    size_t m_evictions = 0;
+};
+
+} // namespace splaytree
+
+#endif
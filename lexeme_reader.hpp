@@ -0,0 +1,217 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * lexeme_reader.hpp
+ *
+ * A whitespace-delimited lexeme scanner for the symbol table test driver.
+ * The original driver used std::istream's extraction operator, which is
+ * locale-aware and copies every lexeme into a std::string. On large inputs
+ * that made iostreams the bottleneck, so this reader works directly on raw
+ * bytes instead: a named file is memory-mapped in its entirety, and anything
+ * that can't be mapped (standard input, pipes, empty files) is read in large
+ * blocks. Lexemes are handed out as std::string_views pointing straight into
+ * the buffer, so nothing is copied unless the caller decides to keep it.
+ *
+ * Whitespace is the same set that isspace() recognizes in the "C" locale:
+ * space, \t, \n, \v, \f, and \r. Where SSE2 is available, we scan sixteen
+ * bytes at a time.
+ */
+
+#ifndef LEXEME_READER_HPP
+#define LEXEME_READER_HPP
+
+#include <cerrno>
+#include <cstddef>
+
+#include <algorithm>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+class lexeme_reader {
+public:
+    /* Read lexemes from standard input. */
+    lexeme_reader () : m_fd(STDIN_FILENO), m_owns_fd(false) {
+        map_or_buffer();
+    }
+
+    /* Read lexemes from the named file. Throws std::system_error if the file
+     * cannot be opened. */
+    explicit lexeme_reader (const char* path)
+            : m_fd(::open(path, O_RDONLY))
+            , m_owns_fd(true) {
+        if (m_fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        map_or_buffer();
+    }
+
+    lexeme_reader (const lexeme_reader&) = delete;
+    lexeme_reader& operator= (const lexeme_reader&) = delete;
+
+    ~lexeme_reader () {
+        if (m_map) {
+            ::munmap(m_map, m_map_length);
+        }
+        if (m_owns_fd) {
+            ::close(m_fd);
+        }
+    }
+
+    /* Store the next lexeme in the given view and return true, or return
+     * false if the input is exhausted. The view remains valid until the next
+     * call to next(). */
+    bool next (std::string_view& lexeme) {
+        for (;;) {
+            m_pos = skip_space(m_pos, m_end);
+
+            if (m_pos != m_end) {
+                auto last = find_space(m_pos, m_end);
+
+                /* A lexeme that runs into the end of the buffer may continue
+                 * in the next block, unless there is no next block. */
+                if (last != m_end || m_eof) {
+                    lexeme = std::string_view(m_pos, last - m_pos);
+                    m_pos = last;
+                    return true;
+                }
+            }
+
+            if (m_eof) {
+                return false;
+            }
+            refill();
+        }
+    }
+
+private:
+    static bool is_space (char c) {
+        /* '\t' through '\r' are contiguous: \t \n \v \f \r. */
+        return ' ' == c || static_cast<unsigned char>(c - '\t') <= '\r' - '\t';
+    }
+
+#if defined(__SSE2__)
+    /* Return a 16-bit mask with one bit set for each whitespace byte in the
+     * sixteen bytes starting at p. */
+    static unsigned space_mask (const char* p) {
+        const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+
+        /* Unsigned x <= 4 if and only if min(x, 4) == x. SSE2 has no unsigned
+         * byte comparison, but it does have an unsigned byte minimum. */
+        const auto shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+        const auto controls = _mm_cmpeq_epi8(
+                _mm_min_epu8(shifted, _mm_set1_epi8('\r' - '\t')), shifted);
+        const auto spaces = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+
+        return static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(controls, spaces)));
+    }
+#endif
+
+    /* Return a pointer to the first non-whitespace byte in [p, end), or end. */
+    static const char* skip_space (const char* p, const char* end) {
+#if defined(__SSE2__)
+        for (; end - p >= 16; p += 16) {
+            auto mask = ~space_mask(p) & 0xffff;
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+#endif
+        while (p != end && is_space(*p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    /* Return a pointer to the first whitespace byte in [p, end), or end. */
+    static const char* find_space (const char* p, const char* end) {
+#if defined(__SSE2__)
+        for (; end - p >= 16; p += 16) {
+            auto mask = space_mask(p);
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+#endif
+        while (p != end && !is_space(*p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    static constexpr size_t block_size = 1 << 20;
+
+    /* Map the whole file if we can. If not, fall back to block reads. */
+    void map_or_buffer () {
+        struct stat st;
+        if (!::fstat(m_fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+            auto length = static_cast<size_t>(st.st_size);
+            auto addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, m_fd, 0);
+            if (MAP_FAILED != addr) {
+                ::madvise(addr, length, MADV_SEQUENTIAL);
+                m_map = addr;
+                m_map_length = length;
+                m_pos = static_cast<const char*>(addr);
+                m_end = m_pos + length;
+                m_eof = true;
+                return;
+            }
+        }
+
+        m_buffer.resize(block_size);
+        m_pos = m_end = m_buffer.data();
+    }
+
+    /* Slide any partial lexeme to the front of the buffer, then read another
+     * block after it. Grows the buffer if a single lexeme fills it. */
+    void refill () {
+        auto offset = static_cast<size_t>(m_pos - m_buffer.data());
+        auto partial = static_cast<size_t>(m_end - m_pos);
+        if (partial == m_buffer.size()) {
+            m_buffer.resize(2 * m_buffer.size());
+        }
+        auto base = m_buffer.data();
+        std::copy(base + offset, base + offset + partial, base);
+
+        ssize_t count;
+        do {
+            count = ::read(m_fd, base + partial, m_buffer.size() - partial);
+        } while (count < 0 && EINTR == errno);
+
+        if (count < 0) {
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+
+        m_eof = !count;
+        m_pos = base;
+        m_end = base + partial + count;
+    }
+
+    int m_fd;
+    bool m_owns_fd;
+
+    void* m_map = nullptr;
+    size_t m_map_length = 0;
+
+    /* Only used when the input could not be mapped. */
+    std::vector<char> m_buffer;
+
+    const char* m_pos = nullptr;
+    const char* m_end = nullptr;
+    bool m_eof = false;
+};
+
+#endif
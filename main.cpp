@@ -24,44 +24,262 @@
  *
  * Both forms should accomplish the same task.
  *
+ * Any number of test files may be given. With more than one, each file gets
+ * its own symbol table, and the files are processed concurrently on a pool
+ * of --jobs=N worker threads (by default, one per hardware thread). Results
+ * are still written to standard output in command-line order, and the time
+ * taken by each file, plus a summary of the whole batch, is written to
+ * standard error:
+ *
+ * $ ./main --jobs=8 testfile1 testfile2 testfile3
+ *
+ * By default the symbol table is dumped in a human-readable format. For
+ * consumption by other tools, pass --format=ndjson or --format=binary (see
+ * symbol_table_scope_manager::display()). In those formats only the dumps
+ * themselves are written to standard output. With several files, each
+ * NDJSON dump is preceded by a {"file":...} line, and the binary dumps are
+ * simply concatenated.
+ *
+ * To see how long individual symbol table operations take, pass --latency.
+ * A histogram of the time taken by each lexeme, in power-of-two buckets of
+ * nanoseconds, is then written to standard error, along with its tail
+ * percentiles. With several files, the histogram covers all of them.
+ *
+ * With --reserved-words, lexemes which are C keywords (see reserved_words
+ * below) are checked for and skipped before they reach the symbol table, as
+ * a compiler front end would do. By default every lexeme is an identifier.
+ *
+ * With a single input, --pipeline splits the work across two threads: one
+ * reads and scans the input, and hands batches of lexemes over a ring
+ * buffer to the other, which updates the symbol table. Reading then
+ * overlaps with tree work, which matters most when the input is a pipe.
+ * How long each stage spent working and waiting on the other is written to
+ * standard error. (With several files, the files themselves are already
+ * processed in parallel, so --pipeline is ignored.)
+ *
  * This program was tested with gcc 4.7.3 and clang 3.2 on an Ubuntu 13.04
- * GNU/Linux system. It uses C++11, so compile like so:
+ * GNU/Linux system. It originally used C++11; the input reader now uses
+ * std::string_view and POSIX memory mapping, and the batch mode uses
+ * std::thread, so compile like so:
  *
- * $ g++ -std=c++11 -o main main.cpp
+ * $ g++ -std=c++17 -pthread -o main main.cpp
  */
 
+#include "lexeme_reader.hpp"
+#include "reserved_words.hpp"
+#include "spsc_ring.hpp"
 #include "symbol_table.hpp"
 
 #include <cassert>
 
-#include <fstream>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+constexpr std::string_view open_scope_lexeme { "{" };
+constexpr std::string_view close_scope_lexeme { "}" };
+
+/* The keywords of C89, for --reserved-words. */
+constexpr std::string_view reserved_word_list[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do",
+    "double", "else", "enum", "extern", "float", "for", "goto", "if", "int",
+    "long", "register", "return", "short", "signed", "sizeof", "static",
+    "struct", "switch", "typedef", "union", "unsigned", "void", "volatile",
+    "while"
+};
+
+constexpr reserved_word_set<std::size(reserved_word_list)> reserved_words { reserved_word_list };
+
+/* Counts of operation latencies, in buckets of nanoseconds: bucket i counts
+ * latencies in [2^(i-1), 2^i), and bucket 0 counts those under 1 ns. */
+struct latency_histogram {
+    using duration = std::chrono::steady_clock::duration;
+
+    void record (duration elapsed);
+    void merge (const latency_histogram& other);
+
+    /* Write the nonempty buckets and the tail percentiles. */
+    void print (std::ostream& output) const;
+
+    std::array<size_t, 64> counts {};
+    size_t total = 0;
+};
+
+/* What the driver does with each lexeme, besides applying it to the symbol
+ * table. */
+struct lexeme_options {
+    /* If not null, time every lexeme into this (--latency). */
+    latency_histogram* latency = nullptr;
+
+    /* Skip reserved words, rather than inserting them as identifiers
+     * (--reserved-words). */
+    bool skip_reserved_words = false;
+};
+
+/* Exercise a symbol table with lexemes from the given reader. */
+void test_symtab (symbol_table_scope_manager& symtab, lexeme_reader& input,
+                  const lexeme_options& options = lexeme_options());
+
+/* Apply a single lexeme to a symbol table. */
+void apply_lexeme (symbol_table_scope_manager& symtab, std::string_view lexeme,
+                   const lexeme_options& options);
+
+/* How long each stage of test_symtab_pipelined() spent working, and how long
+ * it spent waiting for the other stage. */
+struct pipeline_stats {
+    using duration = std::chrono::steady_clock::duration;
 
-const std::string open_scope_lexeme { "{" };
-const std::string close_scope_lexeme { "}" };
+    void print (std::ostream& output) const;
 
-/* Exercise a symbol table with lexemes from the given input stream. */
-void test_symtab (symbol_table_scope_manager& symtab, std::istream& input);
+    duration lexer_busy {};
+    duration lexer_waiting {};
+    duration symtab_busy {};
+    duration symtab_waiting {};
+    size_t batches = 0;
+};
+
+/* Like test_symtab(), but scan the input on a separate thread, which passes
+ * lexemes to this one in batches. Exceptions from either thread are thrown
+ * from here. */
+void test_symtab_pipelined (symbol_table_scope_manager& symtab, lexeme_reader& input,
+                            const lexeme_options& options, pipeline_stats& stats);
+
+/* Parse the argument to --format=. Throws std::invalid_argument if the format
+ * is not recognized. */
+symbol_table_scope_manager::format parse_format (std::string_view name);
+
+/* Parse the argument to --jobs=. Throws std::invalid_argument if it is not a
+ * positive integer. */
+unsigned parse_jobs (std::string_view count);
+
+/* Everything we need to know about one file processed in batch mode. */
+struct file_result {
+    /* The file's symbol table dump, or the reason processing failed. */
+    std::string output;
+    bool failed = false;
+
+    size_t symbols = 0;
+    scope_id scopes = 0;
+    std::chrono::steady_clock::duration elapsed {};
+
+    /* Only filled in with --latency. */
+    latency_histogram latency;
+};
+
+/* Build a symbol table from a single file, and capture its dump. Never
+ * throws: errors are reported through the result. If options.latency is not
+ * null, lexemes are timed into the result's own histogram instead. */
+file_result process_file (const char* path, symbol_table_scope_manager::format fmt,
+                          const lexeme_options& options);
+
+/* Process each file in paths with process_file() on up to jobs threads.
+ * Writes each file's dump to std::cout, in the order the files appear in
+ * paths, and timings to std::cerr. If options.latency is not null, every
+ * file's latencies are merged into it. Returns the program's exit status. */
+int process_files (const std::vector<const char*>& paths,
+                   symbol_table_scope_manager::format fmt, unsigned jobs,
+                   const lexeme_options& options);
 
 //////////////////////////////////////////////////////////////////////////////
 
 int main (int argc, char** argv) try {
+    constexpr std::string_view format_option { "--format=" };
+    constexpr std::string_view jobs_option { "--jobs=" };
+    constexpr std::string_view latency_option { "--latency" };
+    constexpr std::string_view pipeline_option { "--pipeline" };
+    constexpr std::string_view reserved_words_option { "--reserved-words" };
+
+    auto fmt = symbol_table_scope_manager::format::text;
+    unsigned jobs = std::thread::hardware_concurrency();
+    bool time_lexemes = false;
+    bool pipelined = false;
+    lexeme_options options;
+    std::vector<const char*> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg { argv[i] };
+        if (format_option == arg.substr(0, format_option.size())) {
+            fmt = parse_format(arg.substr(format_option.size()));
+        }
+        else if (jobs_option == arg.substr(0, jobs_option.size())) {
+            jobs = parse_jobs(arg.substr(jobs_option.size()));
+        }
+        else if (latency_option == arg) {
+            time_lexemes = true;
+        }
+        else if (pipeline_option == arg) {
+            pipelined = true;
+        }
+        else if (reserved_words_option == arg) {
+            options.skip_reserved_words = true;
+        }
+        else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    latency_histogram latency;
+    if (time_lexemes) {
+        options.latency = &latency;
+    }
+
+    if (paths.size() > 1) {
+        auto status = process_files(paths, fmt, jobs, options);
+        if (time_lexemes) {
+            latency.print(std::cerr);
+        }
+        return status;
+    }
+
     symbol_table_scope_manager symtab;
+    const bool text = symbol_table_scope_manager::format::text == fmt;
+    pipeline_stats stats;
 
-    if (argc > 1) {
+    auto run = [&] (lexeme_reader& input) {
+        if (pipelined) {
+            test_symtab_pipelined(symtab, input, options, stats);
+        }
+        else {
+            test_symtab(symtab, input, options);
+        }
+    };
+
+    if (!paths.empty()) {
         /* Use the file whose name was passed on the command line. */
-        std::cout << "Reading " << argv[1] << '\n';
-        std::ifstream input { argv[1] };
-        test_symtab(symtab, input);
-        input.close();
+        if (text) {
+            std::cout << "Reading " << paths.front() << '\n';
+        }
+        lexeme_reader input { paths.front() };
+        run(input);
     }
     else {
         /* Use stdin. */
-        test_symtab(symtab, std::cin);
+        lexeme_reader input;
+        run(input);
     }
 
-    symtab.display();
-    std::cout << '\n';
+    symtab.display(std::cout, fmt);
+    if (text) {
+        std::cout << '\n';
+    }
+    if (time_lexemes) {
+        latency.print(std::cerr);
+    }
+    if (pipelined) {
+        stats.print(std::cerr);
+    }
     return 0;
 }
 catch (std::exception& exc) {
@@ -73,49 +291,349 @@ catch (...) {
 
 //////////////////////////////////////////////////////////////////////////////
 
-void test_symtab (symbol_table_scope_manager& symtab, std::istream& input) {
-    /* Note that std::istream's extraction operator automatically skips
-     * whitespace. std::string handles all character array allocation,
-     * so our identifiers will be stored without truncation. More
-     * relevantly, the associative data structure underlying the symbol
-     * table also uses std::string as part of its key type, so each
-     * identifier has its own dynamically-allocated section of memory.
-     * lexeme simply serves as an input buffer. */
-    std::string lexeme;
-    while (input >> lexeme) {
-        if (!lexeme.length()) {
-            continue;
+void latency_histogram::record (duration elapsed) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    size_t bucket = 0;
+    for (; ns > 0; ns >>= 1) {
+        ++bucket;
+    }
+    ++counts[std::min(bucket, counts.size() - 1)];
+    ++total;
+}
+
+void latency_histogram::merge (const latency_histogram& other) {
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+}
+
+void latency_histogram::print (std::ostream& output) const {
+    /* The upper bound of bucket i, in nanoseconds. */
+    auto bound = [] (size_t i) { return 1ull << i; };
+
+    output << "lexeme latency (ns)      count\n";
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i]) {
+            output << "  < " << std::setw(12) << std::left << bound(i) << std::right
+                   << std::setw(12) << counts[i] << '\n';
+        }
+    }
+
+    /* Report each percentile as the upper bound of the bucket it falls in. */
+    static const std::pair<const char*, double> percentiles[] = {
+        { "p50", 0.5 }, { "p99", 0.99 }, { "p99.9", 0.999 }, { "p99.99", 0.9999 },
+        { "max", 1.0 }
+    };
+    const char* separator = "";
+    for (auto& percentile : percentiles) {
+        auto rank = static_cast<size_t>(percentile.second * total);
+        size_t seen = 0;
+        size_t i = 0;
+        while (i + 1 < counts.size() && (seen += counts[i]) < std::max<size_t>(rank, 1)) {
+            ++i;
+        }
+        output << separator << percentile.first << " < " << bound(i) << " ns";
+        separator = ", ";
+    }
+    output << '\n';
+}
+
+void test_symtab (symbol_table_scope_manager& symtab, lexeme_reader& input,
+                  const lexeme_options& options) {
+    /* lexeme_reader skips whitespace for us, and hands out views into its
+     * input buffer rather than copies. The associative data structure
+     * underlying the symbol table uses std::string as part of its key type,
+     * so an identifier is only copied into its own dynamically-allocated
+     * section of memory when it is inserted for the first time in a scope.
+     * Until then, lexeme simply points into the input buffer. */
+    std::string_view lexeme;
+    while (input.next(lexeme)) {
+        apply_lexeme(symtab, lexeme, options);
+    }
+}
+
+void apply_lexeme (symbol_table_scope_manager& symtab, std::string_view lexeme,
+                   const lexeme_options& options) {
+    auto latency = options.latency;
+    std::chrono::steady_clock::time_point start;
+    if (latency) {
+        start = std::chrono::steady_clock::now();
+    }
+
+    if (options.skip_reserved_words && reserved_words.contains(lexeme)) {
+        /* A parser would act on the keyword here. We only need to keep it
+         * out of the symbol table. */
+    }
+    else if (open_scope_lexeme == lexeme) {
+        symtab.open_scope();
+    }
+    else if (close_scope_lexeme == lexeme) {
+        symtab.close_scope();
+    }
+    else {
+        /* symbol_table_scope_manager::insert returns a std::pair of an
+         * iterator to the element in question, and a boolean reflecting
+         * whether or not insertion actually took place (i.e., if an
+         * identifier matching lexeme already exists in this scope, this
+         * success flag will be false). I included an assertion below simply
+         * to show that this boolean works as intended. */
+        symbol_table_scope_manager::iterator it;
+        bool success;
+        std::tie(it, success) = symtab.insert(lexeme);
+
+        /* The iterator part of the std::pair "points" to the element, which
+         * is in turn represented by a std::pair of the key and the record. */
+        auto& record = it->second;
+
+        /* Either we successfully inserted, or this identifier appeared in
+         * this scope already. */
+        assert(success || record.reference_count);
+
+        /* Record a reference (in the abstract sense, not the C++ sense) to
+         * this identifier. Mostly just for funsies. */
+        symtab.add_reference(it);
+    }
+
+    if (latency) {
+        latency->record(std::chrono::steady_clock::now() - start);
+    }
+}
+
+void pipeline_stats::print (std::ostream& output) const {
+    using milliseconds = std::chrono::duration<double, std::milli>;
+
+    output << std::fixed << std::setprecision(3)
+           << "lexer: " << milliseconds(lexer_busy).count() << " ms busy, "
+           << milliseconds(lexer_waiting).count() << " ms waiting; "
+           << "symbol table: " << milliseconds(symtab_busy).count() << " ms busy, "
+           << milliseconds(symtab_waiting).count() << " ms waiting; "
+           << batches << " batches\n";
+}
+
+void test_symtab_pipelined (symbol_table_scope_manager& symtab, lexeme_reader& input,
+                            const lexeme_options& options, pipeline_stats& stats) {
+    using clock = std::chrono::steady_clock;
+
+    /* The reader's views only last until its next call, so the lexer copies
+     * each batch's lexemes into one string, and records where each ends. */
+    struct lexeme_batch {
+        std::string text;
+        std::vector<size_t> ends;
+    };
+
+    /* Big enough batches that the two threads rarely touch the ring's
+     * indices, and enough of them that neither waits on the other's
+     * hiccups. */
+    constexpr size_t batch_lexemes = 4096;
+    spsc_ring<lexeme_batch, 16> ring;
+
+    std::exception_ptr lexer_error;
+    std::thread lexer ([&] {
+        const auto start = clock::now();
+        try {
+            std::string_view lexeme;
+            for (bool more = true; more; ) {
+                const auto wait_start = clock::now();
+                auto batch = ring.acquire();
+                stats.lexer_waiting += clock::now() - wait_start;
+                if (!batch) {
+                    break;
+                }
+
+                batch->text.clear();
+                batch->ends.clear();
+                while (batch->ends.size() < batch_lexemes && (more = input.next(lexeme))) {
+                    batch->text.append(lexeme);
+                    batch->ends.push_back(batch->text.size());
+                }
+                if (!batch->ends.empty()) {
+                    ring.publish();
+                }
+            }
+        }
+        catch (...) {
+            lexer_error = std::current_exception();
         }
+        ring.close();
+        stats.lexer_busy = clock::now() - start - stats.lexer_waiting;
+    });
+
+    const auto start = clock::now();
+    try {
+        for (;;) {
+            const auto wait_start = clock::now();
+            auto batch = ring.peek();
+            stats.symtab_waiting += clock::now() - wait_start;
+            if (!batch) {
+                break;
+            }
 
-        if (open_scope_lexeme == lexeme) {
-            symtab.open_scope();
+            size_t begin = 0;
+            for (auto end : batch->ends) {
+                apply_lexeme(symtab, std::string_view(batch->text).substr(begin, end - begin), options);
+                begin = end;
+            }
+            ring.release();
+            ++stats.batches;
         }
-        else if (close_scope_lexeme == lexeme) {
-            symtab.close_scope();
+    }
+    catch (...) {
+        /* Stop the lexer before we leave, so that it doesn't wait forever
+         * for us to make room. */
+        ring.close();
+        lexer.join();
+        throw;
+    }
+    stats.symtab_busy = clock::now() - start - stats.symtab_waiting;
+
+    lexer.join();
+    if (lexer_error) {
+        std::rethrow_exception(lexer_error);
+    }
+}
+
+symbol_table_scope_manager::format parse_format (std::string_view name) {
+    using format = symbol_table_scope_manager::format;
+
+    if ("text" == name) {
+        return format::text;
+    }
+    if ("ndjson" == name) {
+        return format::ndjson;
+    }
+    if ("binary" == name) {
+        return format::binary;
+    }
+    throw std::invalid_argument("unknown format: " + std::string(name));
+}
+
+unsigned parse_jobs (std::string_view count) {
+    unsigned jobs = 0;
+    auto result = std::from_chars(count.data(), count.data() + count.size(), jobs);
+    if (std::errc() != result.ec || count.data() + count.size() != result.ptr || !jobs) {
+        throw std::invalid_argument("invalid job count: " + std::string(count));
+    }
+    return jobs;
+}
+
+file_result process_file (const char* path, symbol_table_scope_manager::format fmt,
+                          const lexeme_options& options) {
+    using format = symbol_table_scope_manager::format;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    file_result result;
+    std::ostringstream output;
+
+    try {
+        if (format::text == fmt) {
+            output << "Reading " << path << '\n';
+        }
+        else if (format::ndjson == fmt) {
+            output_buffer buffer { output, 256 };
+            buffer.write("{\"file\":\"");
+            buffer.write_json_string(path);
+            buffer.write("\"}\n");
+        }
+
+        symbol_table_scope_manager symtab;
+        lexeme_reader input { path };
+        auto file_options = options;
+        if (file_options.latency) {
+            file_options.latency = &result.latency;
+        }
+        test_symtab(symtab, input, file_options);
+
+        symtab.display(output, fmt);
+        if (format::text == fmt) {
+            output << '\n';
+        }
+
+        result.symbols = symtab.size();
+        result.scopes = symtab.scope_count();
+        result.output = output.str();
+    }
+    catch (std::exception& exc) {
+        result.failed = true;
+        result.output = "test failed: " + std::string(exc.what()) + '\n';
+    }
+    catch (...) {
+        result.failed = true;
+        result.output = "unknown exception\n";
+    }
+
+    result.elapsed = std::chrono::steady_clock::now() - start;
+    return result;
+}
+
+int process_files (const std::vector<const char*>& paths,
+                   symbol_table_scope_manager::format fmt, unsigned jobs,
+                   const lexeme_options& options) {
+    using milliseconds = std::chrono::duration<double, std::milli>;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    /* Workers claim files in order, and publish each result through its own
+     * promise. That way we can write out each file's results as soon as it
+     * and every file before it are done, without holding on to the rest. */
+    std::vector<std::promise<file_result>> results (paths.size());
+    std::atomic<size_t> next_path { 0 };
+
+    auto work = [&] {
+        for (size_t i; (i = next_path++) < paths.size(); ) {
+            results[i].set_value(process_file(paths[i], fmt, options));
+        }
+    };
+
+    jobs = std::max(1u, std::min<unsigned>(jobs, paths.size()));
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back(work);
+    }
+
+    size_t failures = 0;
+    size_t symbols = 0;
+    size_t scopes = 0;
+    std::chrono::steady_clock::duration busy {};
+
+    std::cerr << std::fixed << std::setprecision(3);
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        auto result = results[i].get_future().get();
+
+        /* In the machine-readable formats, keep errors off of stdout. */
+        if (result.failed && symbol_table_scope_manager::format::text != fmt) {
+            std::cerr << paths[i] << ": " << result.output;
         }
         else {
-            /* symbol_table_scope_manager::insert returns a std::pair of an
-             * iterator to the element in question, and a boolean reflecting
-             * whether or not insertion actually took place (i.e., if an
-             * identifier matching lexeme already exists in this scope, this
-             * success flag will be false). I included an assertion below
-             * simply to show that this boolean works as intended. */
-            symbol_table_scope_manager::iterator it;
-            bool success;
-            std::tie(it, success) = symtab.insert(lexeme);
-
-            /* The iterator part of the std::pair "points" to the element,
-             * which is in turn represented by a std::pair of the key and the
-             * record. */
-            auto& record = it->second;
-
-            /* Either we successfully inserted, or this identifier appeared in
-             * this scope already. */
-            assert(success || record.reference_count);
-
-            /* Record a reference (in the abstract sense, not the C++ sense)
-             * to this identifier. Mostly just for funsies. */
-            ++record.reference_count;
+            std::cout << result.output;
+        }
+
+        failures += result.failed;
+        symbols += result.symbols;
+        scopes += result.scopes;
+        busy += result.elapsed;
+        if (options.latency) {
+            options.latency->merge(result.latency);
         }
+
+        std::cerr << paths[i] << ": " << result.symbols << " symbols, "
+                  << result.scopes << " scopes, "
+                  << milliseconds(result.elapsed).count() << " ms\n";
     }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "processed " << paths.size() << " files (" << failures
+              << " failed) on " << jobs << " threads: " << symbols
+              << " symbols, " << scopes << " scopes, "
+              << milliseconds(busy).count() << " ms busy, "
+              << milliseconds(elapsed).count() << " ms elapsed\n";
+
+    std::cout.flush();
+    return failures ? 1 : 0;
 }
@@ -0,0 +1,193 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * output_buffer.hpp
+ *
+ * A large write buffer in front of a std::ostream. Formatting many small
+ * fields through operator<< pays for a sentry object, locale lookups, and a
+ * virtual call into the stream buffer on every field. Instead, output_buffer
+ * formats into its own memory with std::to_chars, and hands the stream one
+ * big write() whenever the buffer fills up.
+ */
+
+#ifndef OUTPUT_BUFFER_HPP
+#define OUTPUT_BUFFER_HPP
+
+#include <cstddef>
+
+#include <charconv>
+#include <limits>
+#include <ostream>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+class output_buffer {
+public:
+    explicit output_buffer (std::ostream& output, size_t capacity = 1 << 20)
+            : m_output(output) {
+        m_buffer.reserve(capacity);
+    }
+
+    output_buffer (const output_buffer&) = delete;
+    output_buffer& operator= (const output_buffer&) = delete;
+
+    ~output_buffer () {
+        flush();
+    }
+
+    void put (char c) {
+        reserve(1);
+        m_buffer.push_back(c);
+    }
+
+    /* Write n copies of c. */
+    void fill (size_t n, char c) {
+        reserve(n);
+        m_buffer.insert(m_buffer.end(), n, c);
+    }
+
+    void write (std::string_view str) {
+        /* Don't bother copying strings that would fill the buffer anyway. */
+        if (str.size() >= m_buffer.capacity()) {
+            flush();
+            m_output.write(str.data(), str.size());
+            return;
+        }
+        reserve(str.size());
+        m_buffer.insert(m_buffer.end(), str.begin(), str.end());
+    }
+
+    /* Write an integer in decimal. */
+    template <typename Int>
+    void write_decimal (Int value) {
+        static_assert(std::is_integral<Int>::value, "write_decimal requires an integer");
+
+        char digits[std::numeric_limits<Int>::digits10 + 2];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        write(std::string_view(digits, result.ptr - digits));
+    }
+
+    /* Write an unsigned integer as a LEB128 varint: seven bits per byte,
+     * least significant first, high bit set on all but the last byte. */
+    void write_varint (unsigned long long value) {
+        reserve(10);
+        while (value >= 0x80) {
+            m_buffer.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        m_buffer.push_back(static_cast<char>(value));
+    }
+
+    /* Write the contents of a JSON string literal, without the surrounding
+     * quotes. Quotes, backslashes, and control characters are escaped, and
+     * valid UTF-8 sequences are written as they are. JSON text must be
+     * UTF-8, but identifiers are just bytes, so any byte which isn't part of
+     * a valid sequence is escaped as the code point with the same value
+     * (\u0080 through \u00ff), as if it were Latin-1. Either way, the
+     * output is valid JSON. */
+    void write_json_string (std::string_view str) {
+        for (size_t i = 0; i < str.size(); ) {
+            auto c = str[i];
+            if ('"' == c || '\\' == c) {
+                put('\\');
+                put(c);
+                ++i;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                write_escaped_byte(c);
+                ++i;
+            }
+            else if (static_cast<unsigned char>(c) < 0x80) {
+                put(c);
+                ++i;
+            }
+            else if (auto n = utf8_sequence_length(str.substr(i))) {
+                write(str.substr(i, n));
+                i += n;
+            }
+            else {
+                write_escaped_byte(c);
+                ++i;
+            }
+        }
+    }
+    /* Hand everything buffered so far to the stream. */
+    void flush () {
+        if (!m_buffer.empty()) {
+            m_output.write(m_buffer.data(), m_buffer.size());
+            m_buffer.clear();
+        }
+    }
+
+private:
+    /* Write \u00XX, where XX is c's value in hex. */
+    void write_escaped_byte (char c) {
+        static const char hex[] = "0123456789abcdef";
+        auto byte = static_cast<unsigned char>(c);
+
+        write("\\u00");
+        put(hex[byte >> 4]);
+        put(hex[byte & 0xf]);
+    }
+
+    /* If str starts with a valid multibyte UTF-8 sequence, return its
+     * length, otherwise 0. Overlong encodings, surrogates, and anything past
+     * U+10FFFF are not valid. */
+    static size_t utf8_sequence_length (std::string_view str) {
+        auto byte = [&] (size_t i) { return static_cast<unsigned char>(str[i]); };
+
+        size_t n;
+        unsigned long code_point;
+        unsigned long minimum;
+        if (0xc0 == (byte(0) & 0xe0)) {
+            n = 2;
+            code_point = byte(0) & 0x1f;
+            minimum = 0x80;
+        }
+        else if (0xe0 == (byte(0) & 0xf0)) {
+            n = 3;
+            code_point = byte(0) & 0x0f;
+            minimum = 0x800;
+        }
+        else if (0xf0 == (byte(0) & 0xf8)) {
+            n = 4;
+            code_point = byte(0) & 0x07;
+            minimum = 0x10000;
+        }
+        else {
+            return 0;
+        }
+
+        if (str.size() < n) {
+            return 0;
+        }
+        for (size_t i = 1; i < n; ++i) {
+            if (0x80 != (byte(i) & 0xc0)) {
+                return 0;
+            }
+            code_point = code_point << 6 | (byte(i) & 0x3f);
+        }
+
+        if (code_point < minimum || code_point > 0x10ffff
+                || (code_point >= 0xd800 && code_point <= 0xdfff)) {
+            return 0;
+        }
+        return n;
+    }
+
+    void reserve (size_t n) {
+        if (m_buffer.size() + n > m_buffer.capacity()) {
+            flush();
+        }
+    }
+
+    std::ostream& m_output;
+    std::vector<char> m_buffer;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * reserved_words.hpp
+ *
+ * A fixed set of reserved words, built into a perfect hash table at compile
+ * time. A front end checks every lexeme against its keywords before it goes
+ * anywhere near the symbol table, and keywords are by far the most common
+ * lexemes, so this check had better be cheap. It also had better keep
+ * keywords out of the symbol table: inserting them would splay them to the
+ * root over and over, pushing the identifiers we actually care about further
+ * down.
+ *
+ * The hash only looks at a lexeme's length and its first two and last two
+ * characters, so hashing costs the same for any lexeme, however long. The
+ * constructor searches for a seed under which no two reserved words land in
+ * the same slot. Since it runs at compile time, a list which can't be
+ * hashed perfectly (say, two words which agree on all five of those
+ * things) fails to compile, rather than misbehaving at run time. A lookup is
+ * then one hash, one load, and one comparison against the only word that
+ * could possibly match.
+ */
+
+#ifndef RESERVED_WORDS_HPP
+#define RESERVED_WORDS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include <stdexcept>
+#include <string_view>
+
+template <size_t N>
+class reserved_word_set {
+public:
+    /* Four slots per word leaves enough room that a suitable seed turns up
+     * quickly. */
+    static constexpr size_t table_size = [] {
+        size_t size = 1;
+        while (size < 4 * N) {
+            size *= 2;
+        }
+        return size;
+    }();
+
+    constexpr explicit reserved_word_set (const std::string_view (&words)[N]) {
+        for (size_t i = 0; i < N; ++i) {
+            auto& word = words[i];
+            if (word.empty()) {
+                throw std::invalid_argument("a reserved word cannot be empty");
+            }
+            for (size_t j = 0; j < i; ++j) {
+                if (words[j] == word) {
+                    throw std::invalid_argument("duplicate reserved word");
+                }
+            }
+            m_min_length = word.size() < m_min_length ? word.size() : m_min_length;
+            m_max_length = word.size() > m_max_length ? word.size() : m_max_length;
+        }
+
+        for (m_seed = 1; !try_seed(words); ++m_seed) {
+            if (m_seed > max_seed) {
+                throw std::invalid_argument("no perfect hash for these reserved words");
+            }
+        }
+    }
+
+    constexpr bool contains (std::string_view lexeme) const {
+        if (lexeme.size() - m_min_length > m_max_length - m_min_length) {
+            return false;
+        }
+        return m_table[slot(lexeme, m_seed)] == lexeme;
+    }
+
+    constexpr size_t size () const { return N; }
+
+private:
+    static constexpr std::uint32_t max_seed = 1 << 16;
+
+    static constexpr size_t slot (std::string_view word, std::uint32_t seed) {
+        const auto n = word.size();
+        auto at = [&] (size_t i) { return static_cast<unsigned char>(word[i]); };
+
+        /* n is at least 1 here. For one-character words, all four
+         * characters are the same one, which is fine. */
+        std::uint32_t h = static_cast<std::uint32_t>(n) * 0x9e3779b9u;
+        h = (h ^ at(0)) * seed;
+        h = (h ^ at(n > 1 ? 1 : 0)) * 0x85ebca6bu;
+        h = (h ^ at(n > 1 ? n - 2 : 0)) * seed;
+        h = (h ^ at(n - 1)) * 0xc2b2ae35u;
+        return (h ^ (h >> 15)) & (table_size - 1);
+    }
+
+    constexpr bool try_seed (const std::string_view (&words)[N]) {
+        for (auto& entry : m_table) {
+            entry = std::string_view();
+        }
+        for (auto& word : words) {
+            auto& entry = m_table[slot(word, m_seed)];
+            if (!entry.empty()) {
+                return false;
+            }
+            entry = word;
+        }
+        return true;
+    }
+
+    /* Empty slots hold empty views, which never match a lexeme that passed
+     * the length check. */
+    std::string_view m_table[table_size] {};
+    std::uint32_t m_seed = 0;
+    size_t m_min_length = static_cast<size_t>(-1);
+    size_t m_max_length = 0;
+};
+
+#endif
@@ -1,10 +1,58 @@
+#include "block_set.hpp"
+#include "cache_map.hpp"
 #include "splaytree.hpp"
 
+/* string_map needs std::string_view. */
+#if __cplusplus >= 201703L
+#include "string_map.hpp"
+#endif
+
 #include <cstdio>
 
 #include <algorithm>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <map>
+#include <new>
+#include <stdexcept>
 #include <vector>
 
+/* Monoids for augmented_map<int, int>: the sum of the mapped values, and
+ * the (non-commutative) first key in a range. */
+struct sum_monoid {
+    using result_type = long;
+    result_type identity () const { return 0; }
+    result_type lift (const std::pair<const int, int>& pr) const { return pr.second; }
+    result_type combine (result_type lhs, result_type rhs) const { return lhs + rhs; }
+};
+
+struct first_key_monoid {
+    using result_type = int;
+    result_type identity () const { return -1; }
+    result_type lift (const std::pair<const int, int>& pr) const { return pr.first; }
+    result_type combine (result_type lhs, result_type rhs) const { return -1 != lhs ? lhs : rhs; }
+};
+
+/* A key whose copies can be made to fail. */
+struct fragile_key {
+    static bool fail;
+
+    fragile_key (int k) : key(k) { }
+
+    fragile_key (const fragile_key& other) : key(other.key) {
+        if (fail) {
+            throw std::bad_alloc();
+        }
+    }
+
+    bool operator< (const fragile_key& other) const { return key < other.key; }
+
+    int key;
+};
+
+bool fragile_key::fail = false;
+
 int main () {
     std::vector<int> v;
     for (int i = 0; i < 58; ++i) {
@@ -144,4 +192,743 @@ int main () {
             printf("(%d, %s) : %d\n", pair.first.first, pair.first.second.c_str(), pair.second);
         }
     }
+
+    {
+        /* A snapshot should reproduce both the elements and the shape. */
+        splaytree::map<std::string, int> sm3;
+        for (int i = 0; i < 100; ++i) {
+            sm3[std::to_string(i * 7 % 100)] = i;
+        }
+        sm3.find("42");
+
+        std::stringstream snapshot;
+        sm3.save(snapshot);
+
+        splaytree::map<std::string, int> sm4;
+        sm4.load(snapshot);
+        assert(sm3 == sm4);
+
+        std::stringstream resnapshot;
+        sm4.save(resnapshot);
+        assert(snapshot.str() == resnapshot.str());
+
+        splaytree::set<int> st3;
+        auto str = snapshot.str();
+        try {
+            st3.load(str.data(), str.size() / 2);
+        }
+        catch (std::runtime_error& exc) {
+            printf("exception: %s\n", exc.what());
+        }
+        assert(st3.empty());
+
+        /* Every truncation of a snapshot, wherever it falls, is rejected. */
+        splaytree::set<int> st4 { 3, 1, 4, 5, 9, 2, 6 };
+        std::stringstream intshot;
+        st4.save(intshot);
+        auto ints = intshot.str();
+        for (size_t n = 0; n < ints.size(); ++n) {
+            splaytree::set<int> truncated;
+            try {
+                truncated.load(ints.data(), n);
+                assert(false);
+            }
+            catch (std::runtime_error&) { }
+            assert(truncated.empty());
+        }
+
+        printf("snapshot of %zu elements: %zu bytes\n", sm4.size(), str.size());
+    }
+
+    {
+        /* Run a block_set and a std::set side by side. */
+        splaytree::block_set<int> bs;
+        std::set<int> ref;
+        srand(4110);
+        for (int i = 0; i < 20000; ++i) {
+            int key = rand() % 2000;
+            switch (rand() % 4) {
+                case 0:
+                case 1:
+                    assert(bs.insert(key).second == ref.insert(key).second);
+                    break;
+                case 2:
+                    assert(bs.erase(key) == ref.erase(key));
+                    break;
+                case 3: {
+                    auto it = bs.lower_bound(key);
+                    auto rit = ref.lower_bound(key);
+                    assert((bs.end() == it) == (ref.end() == rit));
+                    assert(bs.end() == it || *it == *rit);
+                    break;
+                }
+            }
+        }
+        assert(bs.size() == ref.size());
+        assert(std::equal(bs.begin(), bs.end(), ref.begin()));
+
+        bs.erase(bs.lower_bound(500), bs.upper_bound(1500));
+        ref.erase(ref.lower_bound(500), ref.upper_bound(1500));
+        assert(bs.size() == ref.size());
+        assert(std::equal(bs.begin(), bs.end(), ref.begin()));
+        printf("block_set: %zu keys\n", bs.size());
+    }
+
+    {
+        /* Skewed accesses, then a rebuild from the access counts. */
+        splaytree::frequency_map<int, int> fm;
+        for (int i = 0; i < 1000; ++i) {
+            fm[i] = i;
+        }
+        for (int i = 0; i < 100000; ++i) {
+            int key = i % 10 ? i % 16 : i % 1000;
+            assert(fm.at(key) == key);
+        }
+        assert(!fm.splaying_paused());
+
+        fm.optimize();
+        assert(fm.splaying_paused());
+        assert(fm.size() == 1000);
+        int expected = 0;
+        for (auto& pr : fm) {
+            assert(pr.first == expected++);
+        }
+        for (int i = 0; i < 10000; ++i) {
+            assert(fm.at(i % 16) == i % 16);
+        }
+        assert(fm.splaying_paused());
+        assert(fm.end() == fm.find(1000));
+        printf("frequency_map: %zu elements\n", fm.size());
+    }
+
+    {
+        /* A cache of at most four elements. */
+        splaytree::cache_map<int, std::string> cache { 4 };
+        std::vector<int> evicted;
+        cache.set_eviction_callback([&] (std::pair<const int, std::string>& pr) {
+            evicted.push_back(pr.first);
+        });
+
+        for (int i = 0; i < 4; ++i) {
+            cache[i] = std::to_string(i);
+        }
+        assert(cache.end() != cache.find(0));
+        cache[4] = "4";
+        assert(1 == evicted.size() && 1 == evicted[0]);
+        assert(cache.end() == cache.find(1));
+        cache.insert(std::make_pair(5, std::string("5")));
+        assert(2 == evicted.size() && 2 == evicted[0 + 1]);
+        assert(4 == cache.size());
+
+        cache.erase(0);
+        cache.set_capacity(2);
+        assert(2 == cache.size() && 3 == evicted.size() && 3 == evicted[2]);
+        assert(cache.end() != cache.find(4) && cache.end() != cache.find(5));
+        printf("cache_map: %zu hits, %zu misses, %zu evictions\n",
+               cache.hits(), cache.misses(), cache.evictions());
+    }
+
+    {
+        /* A byte budget, filled through operator[], which must weigh the
+         * value assigned rather than the empty string it starts out as. */
+        auto weigher = [] (const std::pair<const int, std::string>& pr) {
+            return pr.second.size() + 1;
+        };
+        splaytree::cache_map<int, std::string, std::less<int>, decltype(weigher)> cache { 100, weigher };
+
+        for (int i = 0; i < 10; ++i) {
+            cache[i] = std::string(30, 'x');
+            assert(cache.weight() <= 100);
+        }
+        assert(3 == cache.size() && 93 == cache.weight() && 7 == cache.evictions());
+        assert(cache.end() != cache.find(9) && cache.end() == cache.find(6));
+
+        /* Growing an element in place, then reweighing it, evicts the
+         * least recently used of the others. */
+        auto it = cache.find(9);
+        it->second.append(20, 'y');
+        cache.reweigh(it);
+        assert(2 == cache.size() && 82 == cache.weight());
+        assert(cache.end() == cache.find(7));
+
+        const std::string& value = cache[9];
+        assert(50 == value.size());
+        printf("cache_map: weight %zu of %zu\n", cache.weight(), cache.capacity());
+    }
+
+    {
+        /* Finger searches, with each result the finger for the next. */
+        std::vector<int> keys;
+        for (int i = 0; i < 5000; ++i) {
+            keys.push_back(2 * i);
+        }
+        std::random_shuffle(keys.begin(), keys.end());
+        splaytree::set<int> fs { keys.begin(), keys.end() };
+
+        auto finger = fs.begin();
+        for (int i = 0; i < 10000; ++i) {
+            auto it = fs.find_near(finger, i);
+            assert((fs.end() == it) == (i % 2 == 1));
+            if (fs.end() != it) {
+                assert(*it == i);
+                finger = it;
+            }
+        }
+        for (int i = 0; i < 1000; ++i) {
+            int key = rand() % 10002;
+            auto it = fs.lower_bound_near(finger, key);
+            assert(key > 9998 ? fs.end() == it : *it == key + key % 2);
+            finger = fs.end() == it ? fs.begin() : it;
+        }
+        printf("finger search: ok\n");
+    }
+
+    {
+        /* Range sums against a brute-force std::map. */
+        splaytree::augmented_map<int, int, sum_monoid> sums;
+        splaytree::augmented_map<int, int, first_key_monoid> firsts;
+        std::map<int, int> ref;
+        for (int i = 0; i < 20000; ++i) {
+            int key = rand() % 1000;
+            int lo = rand() % 1100 - 50;
+            int hi = lo + rand() % 200;
+            switch (rand() % 4) {
+            case 0:
+                if (ref.erase(key)) {
+                    sums.erase(sums.find(key));
+                    firsts.erase(firsts.find(key));
+                }
+                break;
+            case 1: {
+                /* Change a mapped value in place. */
+                auto it = sums.find(key);
+                if (sums.end() != it) {
+                    it->second = -it->second;
+                    sums.refresh(it);
+                    ref[key] = it->second;
+                }
+                break;
+            }
+            default:
+                sums.insert(std::make_pair(key, key + 1));
+                firsts.insert(std::make_pair(key, key + 1));
+                ref.insert(std::make_pair(key, key + 1));
+                break;
+            }
+
+            long sum = 0;
+            int first = -1;
+            for (auto it = ref.lower_bound(lo); it != ref.lower_bound(hi); ++it) {
+                sum += it->second;
+                first = -1 != first ? first : it->first;
+            }
+            assert(sums.aggregate(lo, hi) == sum);
+            assert(firsts.aggregate(lo, hi) == first);
+        }
+        assert(sums.size() == ref.size());
+
+        std::stringstream buffer;
+        sums.save(buffer);
+        splaytree::augmented_map<int, int, sum_monoid> loaded;
+        loaded.load(buffer);
+        assert(loaded.aggregate() == sums.aggregate());
+        assert(loaded.aggregate(100, 200) == sums.aggregate(100, 200));
+
+        /* Filling a map through operator[] and at() must keep the sums up to
+         * date, with no other operation in between to hide stale ones. */
+        splaytree::augmented_map<int, int, sum_monoid> am;
+        am[1] = 10;
+        assert(10 == am.aggregate() && 10 == am.aggregate(0, 5));
+        am[2] = 20;
+        am[1] = 5;
+        assert(25 == am.aggregate() && 5 == am.aggregate(0, 2));
+        am.at(1) = 100;
+        assert(120 == am.aggregate() && 100 == am.aggregate(1, 2));
+        am[3] = am[2];
+        assert(140 == am.aggregate());
+        const int& value = am.at(3);
+        assert(20 == value && 20 == am[3].get());
+        try {
+            am.at(4) = 1;
+            assert(false);
+        }
+        catch (std::out_of_range&) { }
+        assert(140 == am.aggregate() && 3 == am.size());
+        printf("augmented_map: %zu elements\n", sums.size());
+    }
+
+    {
+        /* Move elements between maps by relinking their nodes. */
+        splaytree::map<int, std::string> lhs, rhs;
+        for (int i = 0; i < 100; ++i) {
+            (i % 3 ? lhs : rhs)[i] = std::to_string(i);
+        }
+        rhs[1] = "one";
+
+        auto handle = lhs.extract(2);
+        assert(handle && "2" == handle.value().second);
+        assert(lhs.end() == lhs.find(2) && !lhs.extract(2));
+        auto value = &handle.value();
+        auto result = rhs.insert(std::move(handle));
+        assert(result.inserted && !result.node && &*result.position == value);
+
+        result = rhs.insert(lhs.extract(lhs.find(1)));
+        assert(!result.inserted && "1" == result.node.value().second);
+        assert("one" == result.position->second);
+
+        lhs[0] = "zero";
+        rhs.merge(lhs);
+        assert(1 == lhs.size() && "zero" == lhs.begin()->second);
+        assert(100 == rhs.size() && "0" == rhs.begin()->second);
+        int expected = 0;
+        for (auto& pr : rhs) {
+            assert(pr.first == expected++);
+        }
+        printf("node handles: %zu elements\n", rhs.size());
+    }
+
+    {
+        /* Batched lookups, unsorted and sorted, with duplicates. */
+        splaytree::map<int, int> bm;
+        for (int i = 0; i < 10000; i += 2) {
+            bm[i] = -i;
+        }
+
+        std::vector<int> keys;
+        for (int i = 0; i < 1000; ++i) {
+            keys.push_back(rand() % 10100 - 50);
+        }
+        keys.push_back(keys.front());
+
+        std::vector<splaytree::map<int, int>::iterator> found;
+        bm.find_batch(keys.begin(), keys.end(), std::back_inserter(found));
+        assert(found.size() == keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            assert(found[i] == bm.find(keys[i]));
+        }
+
+        std::sort(keys.begin(), keys.end());
+        std::vector<bool> present;
+        bm.contains_batch(keys.begin(), keys.end(), std::back_inserter(present));
+        for (size_t i = 0; i < keys.size(); ++i) {
+            assert(present[i] == (bm.end() != bm.find(keys[i])));
+        }
+        printf("batched lookups: %zu keys\n", keys.size());
+    }
+
+    {
+        /* A threaded set must iterate exactly like an ordinary one. */
+        splaytree::threaded_set<int> ts;
+        std::set<int> ref;
+        for (int i = 0; i < 20000; ++i) {
+            int key = rand() % 2000;
+            if (rand() % 3) {
+                assert(ts.insert(key).second == ref.insert(key).second);
+            }
+            else {
+                assert(ts.erase(key) == ref.erase(key));
+            }
+            auto it = ts.lower_bound(key);
+            auto rit = ref.lower_bound(key);
+            assert((ts.end() == it) == (ref.end() == rit));
+            assert(ts.end() == it || *it == *rit);
+        }
+        assert(std::equal(ts.begin(), ts.end(), ref.begin()));
+
+        std::stringstream buffer;
+        ts.save(buffer);
+        splaytree::threaded_set<int> loaded;
+        loaded.load(buffer);
+        assert(loaded.size() == ref.size());
+        assert(std::equal(loaded.begin(), loaded.end(), ref.begin()));
+        printf("threaded_set: %zu elements\n", ts.size());
+    }
+
+    {
+        /* Compact a scattered map, then keep using it. */
+        splaytree::map<int, std::string> cm;
+        std::map<int, std::string> ref;
+        auto mutate = [&] (int n) {
+            for (int i = 0; i < n; ++i) {
+                int key = rand() % 3000;
+                if (rand() % 3) {
+                    cm[key] = ref[key] = std::to_string(key);
+                }
+                else if (ref.erase(key)) {
+                    cm.erase(cm.find(key));
+                }
+            }
+            assert(cm.size() == ref.size());
+            assert(std::equal(cm.begin(), cm.end(), ref.begin()));
+        };
+
+        mutate(10000);
+        cm.compact();
+        mutate(0);
+        mutate(5000);
+        cm.compact(splaytree::compact_order::in_order);
+        mutate(0);
+
+        /* Extracted nodes must outlive the compacted tree. */
+        auto handle = cm.extract(cm.begin());
+        splaytree::map<int, std::string> other;
+        other.merge(cm);
+        assert(cm.empty() && other.size() == ref.size() - 1);
+        other.insert(std::move(handle));
+        assert(std::equal(other.begin(), other.end(), ref.begin()));
+
+        splaytree::augmented_map<int, int, sum_monoid> am;
+        splaytree::threaded_set<int> ts;
+        for (int i = 0; i < 1000; ++i) {
+            am[i] = i;
+            ts.insert(i);
+        }
+        am.find(500);
+        am.compact();
+        ts.compact(splaytree::compact_order::in_order);
+        assert(am.aggregate(0, 1000) == 999 * 1000 / 2);
+        assert(am.aggregate(10, 20) == 145);
+        assert(std::distance(ts.begin(), ts.end()) == 1000);
+        assert(1000 == *ts.insert(1000).first && 999 == *ts.find(999));
+
+        /* Taking a node out of the arena copies its key. If that throws,
+         * the element must still be in the tree, and the arena still
+         * freed with it in the end. */
+        splaytree::map<fragile_key, int> fm;
+        for (int i = 0; i < 100; ++i) {
+            fm[fragile_key { i }] = i;
+        }
+        fm.compact();
+        splaytree::map<fragile_key, int> target;
+        fragile_key::fail = true;
+        try {
+            fm.extract(fragile_key { 50 });
+            assert(false);
+        }
+        catch (std::bad_alloc&) { }
+        try {
+            target.merge(fm);
+            assert(false);
+        }
+        catch (std::bad_alloc&) { }
+        fragile_key::fail = false;
+        assert(100 == fm.size() && 50 == fm.find(fragile_key { 50 })->second);
+        assert(target.empty());
+        assert(50 == fm.extract(fragile_key { 50 }).value().second);
+        target.merge(fm);
+        assert(fm.empty() && 99 == target.size());
+        printf("compact: %zu elements\n", other.size());
+    }
+
+    {
+        /* Increasing insertions leave a single long path, which the depth
+         * guard must rebuild on the first deep search. */
+        splaytree::set<int> gs;
+        gs.set_depth_guard(3);
+        for (int i = 0; i < 100000; ++i) {
+            gs.insert(i);
+        }
+        for (int i = 0; i < 1000; ++i) {
+            int key = rand() % 100000;
+            assert(key == *gs.find(key));
+        }
+        int expected = 0;
+        for (auto i : gs) {
+            assert(i == expected++);
+        }
+        assert(100000 == expected);
+        printf("depth guard: %zu elements\n", gs.size());
+
+        /* A copy is built by inserting in increasing order, so it starts out
+         * as a path too. It must keep the guard, and lower_bound() must be
+         * guarded as well. */
+        auto copy = gs;
+        assert(100000 == copy.shape_stats().height);
+        assert(0 == *copy.lower_bound(0));
+        assert(copy.shape_stats().height < 100);
+        assert(99999 == *copy.upper_bound(99998));
+        assert(copy.shape_stats().height < 100);
+    }
+
+    {
+        /* Copies keep their access policy's settings. */
+        splaytree::lazy_set<int> ls;
+        ls.set_purge_threshold(1);
+        for (int i = 0; i < 100; ++i) {
+            ls.insert(i);
+        }
+        auto lcopy = ls;
+        for (int i = 0; i < 50; ++i) {
+            lcopy.erase(lcopy.find(i));
+        }
+        assert(50 == lcopy.dead_count() && 50 == lcopy.size());
+
+        splaytree::frequency_map<int, int> fm;
+        fm.set_rebuild_period(10);
+        for (int i = 0; i < 100; ++i) {
+            fm.insert(std::make_pair(i, i));
+        }
+        auto fcopy = fm;
+        for (int i = 0; i < 10; ++i) {
+            fcopy.find(i % 3);
+        }
+        assert(fcopy.splaying_paused() && !fm.splaying_paused());
+    }
+
+    {
+        /* A degenerate path a million nodes long must not overflow the
+         * stack. */
+        splaytree::set<int> ps;
+        for (int i = 0; i < 1000000; ++i) {
+            ps.insert(i);
+        }
+        auto path = ps.shape_stats();
+        assert(1000000 == path.height && 1000000 == path.depth_histogram.size());
+        assert(999999 / 2.0 == path.average_depth);
+        assert(499999 == path.depth_percentile(0.5) && 999999 == path.depth_percentile(1));
+
+        std::ostringstream dot;
+        ps.write_graphviz(dot, 2);
+        assert("digraph splaytree {\n"
+               "  n0 [label=\"999999\"];\n"
+               "  n1 [label=\"999998\"];\n"
+               "  n0 -> n1 [label=L];\n"
+               "  n2 [label=\"999997\"];\n"
+               "  n1 -> n2 [label=L];\n"
+               "  n2_more [label=\"...\", shape=plaintext];\n"
+               "  n2 -> n2_more [style=dashed];\n"
+               "}\n" == dot.str());
+
+        splaytree::map<int, std::string> ms;
+        for (int i = 0; i < 1000; ++i) {
+            ms[rand()] = std::string(i % 2 ? 100 : 1, '"');
+        }
+        auto shape = ms.shape_stats();
+        size_t counted = 0;
+        for (auto n : shape.depth_histogram) {
+            counted += n;
+        }
+        assert(ms.size() == counted && shape.depth_percentile(1) + 1 == shape.height);
+
+        auto usage = ms.memory_usage();
+        assert(ms.size() * sizeof(decltype(ms)::node_type) == usage.node_bytes);
+        assert(usage.heap_bytes >= 500 * 101 && usage.overhead_bytes);
+
+        std::ostringstream json;
+        ms.write_json(json, ms.find(ms.begin()->first), 0);
+        assert(0 == json.str().find("{\"nodes\":[\n{\"id\":0,\"parent\":null,"));
+        printf("shape stats: height %zu for %zu elements\n", shape.height, ms.size());
+    }
+
+    {
+        /* Lazy erasure must look exactly like the real thing from outside. */
+        splaytree::lazy_set<int> ls;
+        std::set<int> reference;
+        size_t purges = 0;
+        for (int i = 0; i < 200000; ++i) {
+            int key = rand() % 5000;
+            if (rand() % 2) {
+                assert(reference.insert(key).second == ls.insert(key).second);
+            }
+            else {
+                auto dead = ls.dead_count();
+                assert(reference.erase(key) == ls.erase(key));
+                purges += ls.dead_count() < dead;
+            }
+            assert(reference.size() == ls.size());
+        }
+        assert(purges && ls.dead_count() <= ls.size() / 3 + 1);
+        assert(std::equal(reference.begin(), reference.end(), ls.begin()));
+        for (int key = 0; key < 5000; ++key) {
+            assert(reference.count(key) == ls.count(key));
+            auto bound = ls.lower_bound(key);
+            auto expected = reference.lower_bound(key);
+            assert(reference.end() == expected ? ls.end() == bound : *expected == *bound);
+        }
+
+        splaytree::lazy_map<int, std::string> lm { { 1, "one" }, { 2, "two" }, { 3, "three" } };
+        lm.set_purge_threshold(1);
+        lm.erase(lm.find(2));
+        assert(1 == lm.dead_count() && 2 == lm.size());
+
+        /* Looking up a dead key is a miss, and leaves the dead node where
+         * it is. */
+        auto shape = lm.shape_stats();
+        assert(lm.end() == lm.find(2) && 0 == lm.count(2));
+        assert(1 == lm.dead_count() && 2 == lm.size());
+        assert(shape.height == lm.shape_stats().height);
+        assert(3 == std::next(lm.begin())->first && 3 == lm.lower_bound(2)->first);
+
+        /* Re-inserting it revives the dead node in place. */
+        auto one = lm.find(1);
+        lm[2] = "deux";
+        assert(0 == lm.dead_count() && 3 == lm.size() && "deux" == lm.find(2)->second);
+        lm.erase(lm.find(2));
+        assert(lm.insert(std::make_pair(2, std::string("zwei"))).second);
+        assert(0 == lm.dead_count() && "zwei" == lm.find(2)->second);
+        assert(1 == one->first && 3 == lm.size());
+        lm.erase(lm.find(1));
+        lm.erase(lm.find(2));
+        lm.erase(lm.find(3));
+        assert(lm.empty() && lm.begin() == lm.end() && 3 == lm.dead_count());
+
+        std::ostringstream snapshot;
+        try {
+            lm.save(snapshot);
+            assert(false);
+        }
+        catch (std::logic_error&) { }
+        lm.purge();
+        assert(0 == lm.dead_count());
+        lm.save(snapshot);
+        printf("lazy erase: %zu elements, %zu purges\n", ls.size(), purges);
+    }
+
+    {
+        /* Filtering out a third of a map in one pass. */
+        splaytree::map<int, int> fm;
+        std::map<int, int> reference;
+        for (int i = 0; i < 100000; ++i) {
+            int key = rand();
+            fm[key] = i;
+            reference[key] = i;
+        }
+        auto third = [] (const std::pair<const int, int>& value) { return 0 == value.second % 3; };
+        auto before = fm.size();
+        auto erased = erase_if(fm, third);
+        for (auto it = reference.begin(); it != reference.end(); ) {
+            it = third(*it) ? reference.erase(it) : std::next(it);
+        }
+        assert(reference.size() == fm.size() && before - fm.size() == erased);
+        assert(std::equal(reference.begin(), reference.end(), fm.begin()));
+        assert(fm.shape_stats().height <= 17);
+
+        splaytree::threaded_set<int> ts { 1, 2, 3, 4, 5, 6 };
+        assert(3 == erase_if(ts, [] (int i) { return i % 2; }));
+        std::vector<int> evens(ts.begin(), ts.end());
+        assert((std::vector<int> { 2, 4, 6 }) == evens);
+
+        splaytree::augmented_map<int, int, sum_monoid> am;
+        for (int i = 0; i < 1000; ++i) {
+            am[i] = i;
+        }
+        assert(900 == erase_if(am, [] (const std::pair<const int, int>& value) { return value.first >= 100; }));
+        assert(100 == am.size() && 99 * 100 / 2 == am.aggregate());
+
+        splaytree::lazy_set<int> ls { 1, 2, 3, 4 };
+        ls.set_purge_threshold(1);
+        ls.erase(ls.find(1));
+        assert(1 == erase_if(ls, [] (int i) { return 1 == i || 4 == i; }));
+        assert(2 == ls.size() && 0 == ls.dead_count());
+        printf("erase_if: %zu of %zu elements left\n", fm.size(), fm.size() + erased);
+    }
+
+    {
+        /* Small batches are spliced in, large ones merged; both must agree
+         * with applying the updates one at a time. */
+        using update = std::pair<splaytree::batch_op, std::pair<const int, int>>;
+        splaytree::map<int, int> bm;
+        splaytree::threaded_map<int, int> tm;
+        splaytree::augmented_map<int, int, sum_monoid> am;
+        splaytree::lazy_map<int, int> lm;
+        std::map<int, int> reference;
+        for (int round = 0; round < 40; ++round) {
+            std::map<int, int> keys;
+            size_t count = round % 2 ? 5 : 2000;
+            while (keys.size() < count) {
+                keys[rand() % 20000] = rand() % 1000;
+            }
+
+            std::vector<update> batch;
+            for (auto& key : keys) {
+                auto op = splaytree::batch_op(rand() % 3);
+                batch.emplace_back(op, key);
+                if (splaytree::batch_op::erase == op) {
+                    reference.erase(key.first);
+                    if (lm.end() != lm.find(key.first) && rand() % 2) {
+                        lm.erase(lm.find(key.first));
+                    }
+                }
+                else if (splaytree::batch_op::upsert == op) {
+                    reference[key.first] = key.second;
+                }
+                else {
+                    reference.insert(key);
+                }
+            }
+            bm.apply_sorted_batch(batch.begin(), batch.end());
+            tm.apply_sorted_batch(batch.begin(), batch.end());
+            am.apply_sorted_batch(batch.begin(), batch.end());
+            lm.apply_sorted_batch(batch.begin(), batch.end());
+
+            assert(reference.size() == bm.size() && reference.size() == tm.size());
+            assert(reference.size() == am.size() && reference.size() == lm.size());
+            assert(std::equal(reference.begin(), reference.end(), bm.begin()));
+            assert(std::equal(reference.begin(), reference.end(), tm.begin()));
+            assert(std::equal(reference.begin(), reference.end(), lm.begin()));
+
+            int sum = 0;
+            for (auto& element : reference) {
+                sum += element.second;
+            }
+            assert(sum == am.aggregate() && sum == am.aggregate(0, 20000));
+        }
+
+        std::vector<update> unsorted { update(splaytree::batch_op::insert, { 2, 0 }),
+                                       update(splaytree::batch_op::insert, { 1, 0 }) };
+        try {
+            bm.apply_sorted_batch(unsorted.begin(), unsorted.end());
+            assert(false);
+        }
+        catch (std::invalid_argument&) { }
+        assert(std::equal(reference.begin(), reference.end(), bm.begin()));
+        printf("sorted batches: %zu elements\n", bm.size());
+    }
+
+#if __cplusplus >= 201703L
+    {
+        /* Keys of every length, from empty to far past any string's small
+         * buffer, must behave as in a std::map. */
+        splaytree::string_map<int> sm;
+        std::map<std::string, int> reference;
+        for (int i = 0; i < 20000; ++i) {
+            std::string key(rand() % 40, 'a');
+            for (auto& c : key) {
+                c += rand() % 4;
+            }
+            if (rand() % 4) {
+                sm[key] += i;
+                reference[key] += i;
+            }
+            else {
+                assert(reference.erase(key) == sm.erase(key));
+            }
+        }
+        assert(reference.size() == sm.size());
+        assert(std::equal(reference.begin(), reference.end(), sm.begin(),
+                [] (const std::pair<const std::string, int>& lhs,
+                    const std::pair<const std::string_view, int>& rhs) {
+                    return lhs.first == rhs.first && lhs.second == rhs.second;
+                }));
+
+        /* Keys are copied in, so the original strings may go away. */
+        splaytree::string_map<std::string> names;
+        {
+            std::string key(100, 'x');
+            assert(names.try_emplace(key, "long").second);
+            assert(!names.try_emplace(key, "again").second);
+            names.insert({ { "", "empty" }, { "b", "short" } });
+        }
+        assert("long" == names.find(std::string(100, 'x'))->second);
+        assert("empty" == names.begin()->second && names.begin()->first.empty());
+        assert("b" == names.lower_bound("a")->first && names.end() == names.lower_bound("y"));
+        assert(1 == names.count("b") && 0 == names.count("c"));
+
+        auto copy = names;
+        names.clear();
+        assert(3 == copy.size() && names.empty());
+        assert(sizeof(decltype(sm)::node_type) + 3 == sm.element_size("abc"));
+        printf("string_map: %zu elements\n", sm.size());
+    }
+#endif
 }
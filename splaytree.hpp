@@ -61,13 +61,25 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 
+#include <algorithm>
 #include <functional>
 #include <initializer_list>
+#include <istream>
 #include <iterator>
 #include <limits>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <sstream>
 #include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 /* iostream is only included for debugging (splaytree::dump_structure()) */
 #include <iostream>
@@ -77,8 +89,388 @@ namespace splaytree {
 template <typename Base>
 class splaytree;
 
+/* Node placement orders for splaytree::compact(). */
+enum class compact_order { breadth_first, in_order };
+
+/* Kinds of update for splaytree::apply_sorted_batch(). */
+enum class batch_op { insert, upsert, erase };
+
+//////////////////////////////////////////////////////////////////////////////
+
+/* Customization point used by splaytree::save() and splaytree::load() to
+ * write and read individual values. Trivially copyable types are written as
+ * their raw bytes, and std::pairs (and so map elements) are written as their
+ * two members in turn. For any other type, specialize serializer with the
+ * same two static member functions. */
+template <typename T, typename Enable = void>
+struct serializer;
+
+template <typename T>
+struct serializer<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+    static void save (std::ostream& output, const T& value) {
+        output.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static T load (std::istream& input) {
+        T value {};
+        input.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    }
+};
+
+template <typename T1, typename T2>
+struct serializer<std::pair<T1, T2>,
+        typename std::enable_if<!std::is_trivially_copyable<std::pair<T1, T2>>::value>::type> {
+    using first_serializer = serializer<typename std::remove_const<T1>::type>;
+    using second_serializer = serializer<typename std::remove_const<T2>::type>;
+
+    static void save (std::ostream& output, const std::pair<T1, T2>& value) {
+        first_serializer::save(output, value.first);
+        second_serializer::save(output, value.second);
+    }
+
+    static std::pair<T1, T2> load (std::istream& input) {
+        /* Function arguments are evaluated in an unspecified order, so read
+         * the first member before constructing the pair. */
+        auto first = first_serializer::load(input);
+        return std::pair<T1, T2>(std::move(first), second_serializer::load(input));
+    }
+};
+
+/* Strings are written as a std::uint64_t length followed by their characters,
+ * which must themselves be trivially copyable. */
+template <typename CharT, typename Traits, typename Alloc>
+struct serializer<std::basic_string<CharT, Traits, Alloc>> {
+    using string_type = std::basic_string<CharT, Traits, Alloc>;
+
+    static void save (std::ostream& output, const string_type& value) {
+        const std::uint64_t length = value.size();
+        output.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        output.write(reinterpret_cast<const char*>(value.data()), length * sizeof(CharT));
+    }
+
+    static string_type load (std::istream& input) {
+        std::uint64_t length = 0;
+        input.read(reinterpret_cast<char*>(&length), sizeof(length));
+
+        /* Read in chunks, so a corrupt length can't make us allocate an
+         * absurd amount of memory before we notice the input ran out. */
+        string_type value;
+        CharT chunk[256];
+        while (input && length) {
+            auto n = std::min<std::uint64_t>(length, sizeof(chunk) / sizeof(CharT));
+            input.read(reinterpret_cast<char*>(chunk), n * sizeof(CharT));
+            value.append(chunk, static_cast<size_t>(n));
+            length -= n;
+        }
+        return value;
+    }
+};
+
+/* Customization point used by splaytree::memory_usage() to count the heap
+ * memory owned by individual values, beyond the bytes of the value itself.
+ * By default values own nothing, and std::pairs own whatever their members
+ * do. For any other type which allocates, specialize heap_usage with the
+ * same static member function. */
+template <typename T, typename Enable = void>
+struct heap_usage {
+    static size_t bytes (const T&) {
+        return 0;
+    }
+};
+
+template <typename T1, typename T2>
+struct heap_usage<std::pair<T1, T2>> {
+    static size_t bytes (const std::pair<T1, T2>& value) {
+        return heap_usage<typename std::remove_const<T1>::type>::bytes(value.first)
+                + heap_usage<typename std::remove_const<T2>::type>::bytes(value.second);
+    }
+};
+
+/* Short strings live inside the string object itself, and own nothing. */
+template <typename CharT, typename Traits, typename Alloc>
+struct heap_usage<std::basic_string<CharT, Traits, Alloc>> {
+    using string_type = std::basic_string<CharT, Traits, Alloc>;
+
+    static size_t bytes (const string_type& value) {
+        auto data = reinterpret_cast<const char*>(value.data());
+        auto self = reinterpret_cast<const char*>(&value);
+        std::less<const char*> less;
+        if (!less(data, self) && less(data, self + sizeof(value))) {
+            return 0;
+        }
+        return (value.capacity() + 1) * sizeof(CharT);
+    }
+};
+
+/* The shape of a splaytree, as measured by splaytree::shape_stats(). Depths
+ * count edges from the root, so the root is at depth 0. */
+struct tree_shape {
+    size_t size = 0;
+
+    /* The number of levels, i.e., one more than the greatest depth. Zero for
+     * an empty tree. */
+    size_t height = 0;
+
+    double average_depth = 0;
+
+    /* depth_histogram[d] is the number of nodes at depth d. */
+    std::vector<size_t> depth_histogram;
+
+    /* Return the smallest depth d such that at least fraction p of the
+     * nodes are at depth d or less, e.g., depth_percentile(0.99). */
+    size_t depth_percentile (double p) const {
+        size_t seen = 0;
+        for (size_t d = 0; d < depth_histogram.size(); ++d) {
+            seen += depth_histogram[d];
+            if (seen >= p * size) {
+                return d;
+            }
+        }
+        return height ? height - 1 : 0;
+    }
+};
+
+/* Where a splaytree's memory goes, as measured by
+ * splaytree::memory_usage(). */
+struct memory_footprint {
+    /* The nodes themselves: links, auxiliary data, and values. */
+    size_t node_bytes = 0;
+
+    /* Memory owned by the values, as reported by heap_usage. */
+    size_t heap_bytes = 0;
+
+    /* An estimate of what the allocator spends on top of the nodes: headers
+     * and rounding for individually allocated nodes, and the unused slots
+     * of a compacted tree's arena. */
+    size_t overhead_bytes = 0;
+
+    size_t total () const {
+        return node_bytes + heap_bytes + overhead_bytes;
+    }
+};
+
 namespace detail {
 
+/* Estimate the memory malloc really spends on an allocation of n bytes. A
+ * typical malloc prepends one word of bookkeeping, rounds up to a multiple
+ * of two words, and has a minimum chunk size of four words. */
+inline size_t allocation_size (size_t n) {
+    const size_t word = sizeof(size_t);
+    auto chunk = (n + word + 2 * word - 1) / (2 * word) * (2 * word);
+    return std::max(chunk, 4 * word);
+}
+
+/* The default labels for splaytree::write_graphviz() and write_json(): a set
+ * element itself, or a map element's key, written with operator<<. */
+struct default_labeler {
+    template <typename T>
+    void operator() (std::ostream& output, const T& value) const {
+        output << value;
+    }
+
+    template <typename T1, typename T2>
+    void operator() (std::ostream& output, const std::pair<T1, T2>& value) const {
+        output << value.first;
+    }
+};
+
+/* Write str as the contents of a double-quoted string, escaping quotes and
+ * backslashes, and for JSON, control characters as well. */
+inline void write_quoted (std::ostream& output, const std::string& str, bool json) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (auto c : str) {
+        if ('"' == c || '\\' == c) {
+            output.put('\\');
+            output.put(c);
+        }
+        else if (json && static_cast<unsigned char>(c) < 0x20) {
+            output << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        }
+        else {
+            output.put(c);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/* Three-way comparison. Searching a binary tree with a less-than comparison
+ * takes two comparisons per level: one to see if we should go left, and one
+ * to see if we should go right. With a three-way comparison, which tells us
+ * less, equal, or greater all at once, we only need one. For keys like
+ * strings, or pairs containing strings, each comparison is a walk over the
+ * characters, so this is well worth doing.
+ *
+ * A comparison object supports three-way comparison if it has a member
+ * function three_way(lhs, rhs) which returns a negative, zero, or positive
+ * int (or a C++20 ordering) like std::string::compare() does. std::less also
+ * supports it, using compare() for strings and string_views, operator<=> where
+ * available, and otherwise two operator< calls. For std::pairs, each member
+ * is compared this way in turn. All other comparison objects fall back to
+ * two calls per level. */
+
+/* An overload taking priority<N> is preferred to one taking priority<N - 1>. */
+template <unsigned N>
+struct priority : priority<N - 1> { };
+
+template <>
+struct priority<0> { };
+
+/* Collapse the result of a three-way comparison to -1, 0, or 1. */
+template <typename Order>
+int order_sign (const Order& order) {
+    return order < 0 ? -1 : 0 < order;
+}
+
+template <typename T>
+int three_way_value (const T& lhs, const T& rhs, priority<0>) {
+    return (rhs < lhs) - (lhs < rhs);
+}
+
+#if defined(__cpp_lib_three_way_comparison)
+template <typename T>
+auto three_way_value (const T& lhs, const T& rhs, priority<1>)
+        -> decltype(order_sign(lhs <=> rhs)) {
+    return order_sign(lhs <=> rhs);
+}
+#endif
+
+template <typename CharT, typename Traits, typename Alloc>
+int three_way_value (const std::basic_string<CharT, Traits, Alloc>& lhs,
+                     const std::basic_string<CharT, Traits, Alloc>& rhs, priority<2>) {
+    return order_sign(lhs.compare(rhs));
+}
+
+#if defined(__cpp_lib_string_view)
+template <typename CharT, typename Traits>
+int three_way_value (const std::basic_string_view<CharT, Traits>& lhs,
+                     const std::basic_string_view<CharT, Traits>& rhs, priority<2>) {
+    return order_sign(lhs.compare(rhs));
+}
+#endif
+
+template <typename T1, typename T2>
+int three_way_value (const std::pair<T1, T2>& lhs, const std::pair<T1, T2>& rhs, priority<2>) {
+    if (auto order = three_way_value(lhs.first, rhs.first, priority<2>())) {
+        return order;
+    }
+    return three_way_value(lhs.second, rhs.second, priority<2>());
+}
+
+template <typename Compare, typename Lhs, typename Rhs>
+auto three_way (const Compare& comp, const Lhs& lhs, const Rhs& rhs, priority<1>)
+        -> decltype(order_sign(comp.three_way(lhs, rhs))) {
+    return order_sign(comp.three_way(lhs, rhs));
+}
+
+template <typename T>
+int three_way (const std::less<T>&, const T& lhs, const T& rhs, priority<0>) {
+    return three_way_value(lhs, rhs, priority<2>());
+}
+
+/* Return -1, 0, or 1 as lhs is less than, equivalent to, or greater than rhs
+ * according to comp. Only participates in overload resolution if comp
+ * supports three-way comparison. */
+template <typename Compare, typename Lhs, typename Rhs>
+auto three_way (const Compare& comp, const Lhs& lhs, const Rhs& rhs)
+        -> decltype(three_way(comp, lhs, rhs, priority<1>())) {
+    return three_way(comp, lhs, rhs, priority<1>());
+}
+
+template <typename Compare, typename Lhs, typename Rhs, typename = void>
+struct has_three_way : std::false_type { };
+
+template <typename Compare, typename Lhs, typename Rhs>
+struct has_three_way<Compare, Lhs, Rhs, decltype(void(three_way(std::declval<const Compare&>(),
+        std::declval<const Lhs&>(), std::declval<const Rhs&>())))> : std::true_type { };
+
+//////////////////////////////////////////////////////////////////////////////
+
+/* Auxiliary per-node data. Every node derives from an auxiliary data class,
+ * so that optional features can keep their own bookkeeping in each node.
+ * Trees that don't use any such feature use empty_aux, which costs nothing
+ * thanks to the empty base optimization. */
+struct empty_aux { };
+
+/* Auxiliary data for frequency_access_tag: a saturating access counter. */
+struct access_count_aux {
+    std::uint32_t m_hits = 0;
+};
+
+/* Auxiliary data for augmented_access_tag: the monoid sum of every value in
+ * the node's subtree, in symmetric order. A Monoid is a stateless,
+ * default-constructible class with a result_type and three member
+ * functions:
+ *
+ *   result_type identity () const;
+ *   result_type lift (const value_type& value) const;
+ *   result_type combine (const result_type& lhs, const result_type& rhs) const;
+ *
+ * combine() must be associative, with identity() as its identity, but need
+ * not be commutative. */
+template <typename Monoid>
+struct monoid_aux {
+    typename Monoid::result_type m_summary {};
+};
+
+/* Auxiliary data for threaded_access_tag: links to the node's in-order
+ * predecessor and successor, or nullptr at either end. Rotations never
+ * change the symmetric order, so these only need fixing when a node enters
+ * or leaves the tree. */
+struct thread_aux {
+    thread_aux* m_prev = nullptr;
+    thread_aux* m_next = nullptr;
+
+    /* Link this node into the thread just before or after other. */
+    void link_before (thread_aux* other) {
+        m_prev = other->m_prev;
+        m_next = other;
+        relink();
+    }
+
+    void link_after (thread_aux* other) {
+        m_prev = other;
+        m_next = other->m_next;
+        relink();
+    }
+
+    void unlink () {
+        if (m_prev) {
+            m_prev->m_next = m_next;
+        }
+        if (m_next) {
+            m_next->m_prev = m_prev;
+        }
+        m_prev = m_next = nullptr;
+    }
+
+private:
+    void relink () {
+        if (m_prev) {
+            m_prev->m_next = this;
+        }
+        if (m_next) {
+            m_next->m_prev = this;
+        }
+    }
+};
+
+/* Auxiliary data for lazy_erase_access_tag: whether the element has been
+ * erased, but not yet removed from the tree. */
+struct tombstone_aux {
+    bool m_dead = false;
+};
+
+/* Whether node auxiliary data depends on the shape of the tree, and so must
+ * be recomputed whenever the shape changes. */
+template <typename Aux>
+struct is_augmented : std::false_type { };
+
+template <typename Monoid>
+struct is_augmented<monoid_aux<Monoid>> : std::true_type { };
+
 //////////////////////////////////////////////////////////////////////////////
 
 /* A node in a splaytree. This class has two levels of implementation:
@@ -89,28 +481,32 @@ namespace detail {
  * functions that operate on pointers to node.
  *
  * The template parameter, T, is the user-specified value type stored in every
- * node of the tree.
+ * node of the tree. Aux is the auxiliary data class described above.
  *
  * TODO separate the linkage (parent, left, right pointers) from the node
  * class and put it in a separate node_base class, from which node derives.
  * Implement as many tree operations as possible in terms of this node_base
  * class (i.e., not in a header file). This will also be necessary in order to
  * support bidirectional iteration. */
-template <typename T>
-class node {
+template <typename T, typename Aux = empty_aux>
+class node : public Aux {
 public:
     using value_type = T;
 
     explicit node (const value_type& value)
-            : m_value(value) { }
+            : m_value(value) {
+        update();
+    }
 
     template <typename... Args>
     explicit node (Args&&... args)
-            : m_value(std::forward<Args>(args)...) { }
+            : m_value(std::forward<Args>(args)...) {
+        update();
+    }
 
     ~node () {
-        delete left();
-        delete right();
+        destroy_subtree(left());
+        destroy_subtree(right());
     }
 
     /* Attach a child. We must not already have a child in that position,
@@ -156,33 +552,170 @@ public:
     /* Descend the tree s, searching for the given value with the given
      * comparison function. Return a pointer to the found element, or the node
      * to which the value in question would have been attached, if not found.
-     * Does NOT modify the tree. */
-    template <typename Compare>
-    static node* search_no_splay (node* s, const value_type& value, const Compare& comp) {
-        node* p = nullptr;
+     * Does NOT modify the tree.
+     *
+     * The search value need not be a value_type, so long as comp can compare
+     * it against one in both directions.
+     *
+     * order is set to -1, 0, or 1 as the search value is less than,
+     * equivalent to, or greater than the returned node's value. If comp
+     * supports three-way comparison, this takes one comparison per level;
+     * otherwise, two. */
+    template <typename Key, typename Compare>
+    static node* search_no_splay (node* s, const Key& value, const Compare& comp, int& order) {
+        size_t depth;
+        return search_no_splay(s, value, comp, order, depth);
+    }
 
-        while (s) {
-            p = s;
-            if (comp(value, s->m_value)) {
-                s = s->left();
+    template <typename Key, typename Compare>
+    static node* search_no_splay (node* s, const Key& value, const Compare& comp) {
+        int order;
+        return search_no_splay(s, value, comp, order);
+    }
+
+    /* Same as above, but also sets depth to the number of nodes visited. */
+    template <typename Key, typename Compare>
+    static node* search_no_splay (node* s, const Key& value, const Compare& comp,
+                                  int& order, size_t& depth) {
+        return search_no_splay(s, value, comp, order, depth,
+                has_three_way<Compare, Key, value_type>());
+    }
+
+    /* Same as search_no_splay, except the return value is also the new root
+     * of the tree. DOES modify the tree. */
+    template <typename Key, typename Compare>
+    static node* search (node* s, const Key& value, const Compare& comp, int& order) {
+        s = search_no_splay(s, value, comp, order);
+
+        if (s) {
+            s->splay();
+        }
+
+        return s;
+    }
+
+    template <typename Key, typename Compare>
+    static node* search (node* s, const Key& value, const Compare& comp) {
+        int order;
+        return search(s, value, comp, order);
+    }
+
+    /* Same as search, except that if the search visits more than max_depth
+     * nodes, the path it took is first rebuilt into a balanced tree (see
+     * rebuild_path()), so that splaying the found node is cheap, and so is
+     * every later search along that path. DOES modify the tree. */
+    template <typename Key, typename Compare>
+    static node* search (node* s, const Key& value, const Compare& comp, int& order,
+                         size_t max_depth) {
+        size_t depth;
+        s = search_no_splay(s, value, comp, order, depth);
+
+        if (s) {
+            if (depth > max_depth) {
+                rebuild_path(s, depth);
             }
-            else if (comp(s->m_value, value)) {
-                s = s->right();
+            s->splay();
+        }
+
+        return s;
+    }
+
+    /* Rebuild the path from the root of s's tree down to s, which visits
+     * length nodes, into a balanced tree, leaving the subtrees hanging off the path where they are in
+     * symmetric order. This takes time proportional to the length of the
+     * path, i.e., to the cost of the search which found s, and afterwards s
+     * and every other node on the path is within about log2 of the path's
+     * length of the root. DOES modify the tree. */
+    static void rebuild_path (node* s, size_t length) {
+        /* In symmetric order, the path's nodes which it leaves to the right
+         * come before s, top to bottom, and those it leaves to the left come
+         * after s, bottom to top. Climbing from s, we meet both kinds bottom
+         * to top, so collect the first kind from the front of nodes and the
+         * second from the back, and then turn both runs around. */
+        std::vector<node*> nodes (length);
+        auto lo = nodes.begin();
+        auto hi = nodes.end();
+        for (auto p = s; p->m_parent; p = p->m_parent) {
+            if (p->m_parent->right() == p) {
+                *lo++ = p->m_parent;
             }
             else {
+                *--hi = p->m_parent;
+            }
+        }
+        assert(lo + 1 == hi);
+
+        *lo = s;
+        std::reverse(nodes.begin(), lo);
+        std::reverse(hi, nodes.end());
+
+        auto root = build_path(nodes, lo - nodes.begin(), 0, length);
+        root->m_parent = nullptr;
+    }
+
+    /* Finger search: same as search_no_splay, except the search starts from
+     * the node finger instead of the root. We climb from the finger only
+     * until we reach a subtree which must contain the value, then descend.
+     * When the value is near the finger in symmetric order, this touches far
+     * fewer nodes than a search from the root. Does NOT modify the tree. */
+    template <typename Key, typename Compare>
+    static node* search_from_no_splay (node* finger, const Key& value,
+                                       const Compare& comp, int& order) {
+        assert(finger);
+
+        auto s = finger;
+        order = compare(value, s->m_value, comp);
+        if (!order) {
+            return s;
+        }
+
+        while (s->m_parent) {
+            auto p = s->m_parent;
+            auto left = p->left() == s;
+
+            /* If value lies beyond s's subtree on the same side as p, then p
+             * tells us nothing; keep climbing. */
+            if (left == (order < 0)) {
+                s = p;
+                continue;
+            }
+
+            /* Otherwise, if value falls between the finger and p, it must be
+             * in s's subtree. */
+            auto c = compare(value, p->m_value, comp);
+            if (!c) {
+                order = 0;
+                return p;
+            }
+            if ((c < 0) == left) {
                 break;
             }
+            s = p;
         }
 
-        return p;
+        return search_no_splay(s, value, comp, order);
     }
 
-    /* Same as search_no_splay, except the return value is also the new root
-     * of the tree. DOES modify the tree. */
-    template <typename Compare>
-    static node* search (node* s, const value_type& value, const Compare& comp) {
-        s = search_no_splay(s, value, comp);
+    /* Same as search_from_no_splay, except the return value is also the new
+     * root of the tree. DOES modify the tree. */
+    template <typename Key, typename Compare>
+    static node* search_from (node* finger, const Key& value, const Compare& comp, int& order) {
+        auto s = search_from_no_splay(finger, value, comp, order);
+        s->splay();
+        return s;
+    }
 
+    /* Finger search version of lower_bound, for trees with unique keys.
+     * Returns the new root of the tree, IF it is not null. DOES modify the
+     * tree. */
+    template <typename Key, typename Compare>
+    static node* lower_bound_from (node* finger, const Key& value, const Compare& comp) {
+        int order;
+        auto s = search_from_no_splay(finger, value, comp, order);
+
+        if (order > 0) {
+            s = increment(s);
+        }
         if (s) {
             s->splay();
         }
@@ -190,6 +723,178 @@ public:
         return s;
     }
 
+    /* Search the tree s for every value in the sorted range [first, last) in
+     * one walk: each node splits the values still being looked for into
+     * those that belong in its left subtree, those equivalent to it, and
+     * those that belong in its right subtree. found(it, s) is called for
+     * every value *it equivalent to a node s. Returns the deepest node
+     * visited, or nullptr if the tree is empty. Does NOT modify the tree.
+     *
+     * Looking up m values in a balanced tree of n nodes this way takes
+     * O(m log(n / m)) comparisons, instead of O(m log n). */
+    template <typename Iter, typename Compare, typename Found>
+    static node* search_sorted (node* s, Iter first, Iter last, const Compare& comp,
+                                Found found) {
+        struct pending {
+            node* s;
+            Iter first;
+            Iter last;
+            size_t depth;
+        };
+
+        node* deepest = s;
+        size_t max_depth = 0;
+
+        /* An explicit stack, since a splay tree may be arbitrarily deep. */
+        std::vector<pending> stack;
+        if (s && first != last) {
+            stack.push_back(pending { s, first, last, 0 });
+        }
+
+        while (!stack.empty()) {
+            auto top = stack.back();
+            stack.pop_back();
+            s = top.s;
+
+            if (top.depth > max_depth) {
+                max_depth = top.depth;
+                deepest = s;
+            }
+
+            auto lo = std::lower_bound(top.first, top.last, s->m_value,
+                    [&] (const typename std::iterator_traits<Iter>::value_type& key,
+                         const value_type& value) { return comp(key, value); });
+            auto hi = std::upper_bound(lo, top.last, s->m_value,
+                    [&] (const value_type& value,
+                         const typename std::iterator_traits<Iter>::value_type& key) {
+                        return comp(value, key);
+                    });
+
+            for (auto it = lo; it != hi; ++it) {
+                found(it, s);
+            }
+
+            if (hi != top.last && s->right()) {
+                stack.push_back(pending { s->right(), hi, top.last, top.depth + 1 });
+            }
+            if (top.first != lo && s->left()) {
+                stack.push_back(pending { s->left(), top.first, lo, top.depth + 1 });
+            }
+        }
+
+        return deepest;
+    }
+
+    /* Splay s to the root and return it. DOES modify the tree. */
+    static node* splay_to_root (node* s) {
+        assert(s);
+        s->splay();
+        return s;
+    }
+
+    /* Arrange the tree rooted at root so that every value in [lo, hi), and
+     * nothing else, is in one subtree, and return that subtree's root, or
+     * nullptr if the range is empty. lo's predecessor is splayed to the root
+     * and hi's lower bound just below it, so the subtree is the left child
+     * of the one or the right child of the other. root is set to the new
+     * root. DOES modify the tree. */
+    template <typename Compare>
+    static node* isolate (node*& root, const value_type& lo, const value_type& hi,
+                          const Compare& comp) {
+        if (!root || !comp(lo, hi)) {
+            return nullptr;
+        }
+
+        auto first = lower_bound_no_splay(root, lo, comp);
+        auto before = first ? decrement(first) : maximum(root);
+        auto after = lower_bound_no_splay(root, hi, comp);
+
+        if (before) {
+            before->splay();
+            root = before;
+        }
+        if (after) {
+            after->splay(before);
+            if (!before) {
+                root = after;
+            }
+            return after->left();
+        }
+        return before ? before->right() : root;
+    }
+
+    /* Splay s to the root and recompute its auxiliary data, which is
+     * necessary after its value changes if the tree is augmented. Returns
+     * the new root of the tree. DOES modify the tree. */
+    static node* refresh (node* s) {
+        assert(s);
+        s->splay();
+        s->update();
+        return s;
+    }
+
+    /* Move every value in the tree s into a new node made by
+     * construct(value_type&&), keeping the same shape, and return the new
+     * root. The new nodes are made in breadth-first order, or in symmetric
+     * order if in_order is true. Each old node is then emptied of its
+     * links and passed to release(node*). DOES modify the tree. */
+    template <typename Construct, typename Release>
+    static node* relocate (node* s, bool in_order, Construct construct, Release release) {
+        std::vector<node*> nodes;
+        if (in_order) {
+            for (s = minimum(s); s; s = increment(s)) {
+                nodes.push_back(s);
+            }
+        }
+        else if (s) {
+            nodes.push_back(s);
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (nodes[i]->left()) {
+                    nodes.push_back(nodes[i]->left());
+                }
+                if (nodes[i]->right()) {
+                    nodes.push_back(nodes[i]->right());
+                }
+            }
+        }
+
+        /* Once we have every old node, their parent links are only dead
+         * weight, so use them as forwarding pointers to the new nodes. */
+        node* root = nullptr;
+        for (auto p : nodes) {
+            auto fresh = construct(std::move(p->m_value));
+            fresh->copy_aux(*p, static_cast<Aux*>(fresh));
+            if (!p->m_parent) {
+                root = fresh;
+            }
+            p->m_parent = fresh;
+        }
+
+        for (auto p : nodes) {
+            auto fresh = p->m_parent;
+            if (p->left()) {
+                fresh->left() = p->left()->m_parent;
+                fresh->left()->m_parent = fresh;
+            }
+            if (p->right()) {
+                fresh->right() = p->right()->m_parent;
+                fresh->right()->m_parent = fresh;
+            }
+        }
+
+        for (auto p : nodes) {
+            p->m_parent = nullptr;
+            p->m_children = std::make_pair(nullptr, nullptr);
+            release(p);
+        }
+
+        if (is_augmented<Aux>::value) {
+            update_all(root);
+        }
+        thread_all(root, static_cast<Aux*>(root));
+        return root;
+    }
+
     /* Join two roots into a single tree. The new root will be the largest
      * element in the left-hand tree. If the left-hand tree is null, the new
      * root will be the right-hand tree. */
@@ -212,25 +917,588 @@ public:
         return root;
     }
 
-    /* Remove and delete the given node from its tree. Return a pointer to the
-     * new root of the tree. DOES modify the tree. */
-    static node* erase (node* s) {
+    /* Remove the given node from its tree without deleting it, leaving it
+     * with no parent or children. Return a pointer to the new root of the
+     * tree. DOES modify the tree. */
+    static node* extract (node* s) {
         assert(s);
+        s->unthread(static_cast<Aux*>(s));
         s->splay();
         auto lhs = s->detach_left();
         auto rhs = s->detach_right();
+        return join(lhs, rhs);
+    }
+
+    /* Remove and delete the given node from its tree. Return a pointer to the
+     * new root of the tree. DOES modify the tree. */
+    static node* erase (node* s) {
+        auto root = extract(s);
         delete s;
         s = nullptr;
-        return join(lhs, rhs);
+        return root;
+    }
+
+    /* Tell a threaded tree that s, a new node, is about to be linked in just
+     * before (order < 0) or after (order > 0) neighbor. Does nothing for
+     * other trees. */
+    static void thread (node* s, node* neighbor, int order) {
+        s->thread(neighbor, order, static_cast<Aux*>(s));
+    }
+
+    /* Return true if s has been erased from a tree with tombstones (see
+     * lazy_erase_access_tag), but is still linked into it. */
+    static bool is_dead (const node* s) {
+        return is_dead(s, static_cast<const Aux*>(s));
+    }
+
+    /* Return s, unless it is dead, in which case return the next node which
+     * isn't. Lookups that land on a dead node use this to step past it. */
+    static node* live (node* s) {
+        return s && is_dead(s) ? increment(s) : s;
     }
 
     /* Traverse the tree to the next node, in-order. Does NOT modify the tree.
-     * FIXME some code duplication with decrement() here. */
+     * In a threaded tree, this takes constant time. In a tree with
+     * tombstones, dead nodes are skipped. */
     static node* increment (node* s) {
         if (!s) {
             return nullptr;
         }
 
+        return increment(s, static_cast<Aux*>(s));
+    }
+
+    /* Traverse the tree to the previous node, in-order. Does NOT modify the
+     * tree. In a threaded tree, this takes constant time. */
+    static node* decrement (node* s) {
+        if (!s) {
+            return nullptr;
+        }
+
+        return decrement(s, static_cast<Aux*>(s));
+    }
+
+    /* Return a pointer to the smallest node whose key is greater than or
+     * equal to the given value. As with search_no_splay, the value need not
+     * be a value_type. Does NOT modify the tree. */
+    template <typename Key, typename Compare>
+    static node* lower_bound_no_splay (node* s, const Key& value, const Compare& comp) {
+        int order;
+        s = search_no_splay(s, value, comp, order);
+
+        if (!s) {
+            return nullptr;
+        }
+
+        /* If this node is less than the search key, then the search key was
+         * not found. The next node must be the first node that is not less
+         * than the search key. */
+        if (order > 0) {
+            return increment(s);
+        }
+
+        /* This node is greater than or equal to the search key. Decrement
+         * until we find the first node that is not less than the search key.
+         */
+        auto p = s;
+        while (p && !comp(p->value(), value)) {
+            s = p;
+            p = decrement(p);
+        }
+
+        return s;
+    }
+
+    /* Same as lower_bound_no_splay, except the return value is also the new
+     * root of the tree, IF it is not null. If it is null, this simply means
+     * that the lower bound is past the end of the tree. DOES modify the tree.
+     */
+    template <typename Key, typename Compare>
+    static node* lower_bound (node* s, const Key& value, const Compare& comp) {
+        s = lower_bound_no_splay(s, value, comp);
+
+        if (s) {
+            s->splay();
+        }
+
+        return s;
+    }
+
+    /* Return a pointer to the smallest node whose key is greater than the 
+     * given value. Does NOT modify the tree. */
+    template <typename Key, typename Compare>
+    static node* upper_bound_no_splay (node* s, const Key& value, const Compare& comp) {
+        int order;
+        s = search_no_splay(s, value, comp, order);
+
+        if (!s) {
+            return nullptr;
+        }
+
+        if (order > 0) {
+            return increment(s);
+        }
+
+        /* This node is greater than or equal to the search key. Increment
+         * until we find a node that is strictly greater. */
+        while (s && !comp(value, s->value())) {
+            s = increment(s);
+        }
+
+        return s;
+    }
+
+    /* Same as upper_bound_no_splay, except the return value is also the new
+     * root of the tree, IF it is not null. If it is null, this simply means
+     * that the upper bound is past the end of the tree. DOES modify the tree. */
+    template <typename Key, typename Compare>
+    static node* upper_bound (node* s, const Key& value, const Compare& comp) {
+        s = upper_bound_no_splay(s, value, comp);
+
+        if (s) {
+            s->splay();
+        }
+
+        return s;
+    }
+
+    /* Rearrange the tree s into a nearly optimal binary search tree for the
+     * given weights, and return its new root. weight(s) is called exactly
+     * once for each node, in order, and must return a positive weight. Sets
+     * average_depth to the weighted average number of nodes a search for
+     * each node visits in the new tree. DOES modify the tree.
+     *
+     * This uses Mehlhorn's bisection heuristic: the root of each subtree is
+     * the node whose weight straddles the middle of the subtree's total
+     * weight. A search for a node of weight w in a tree of total weight W
+     * then visits at most about log2(W / w) + 2 nodes, which is within a
+     * constant of optimal. Looking for the middle from both ends of the
+     * range at once makes the whole rebuild take O(n) time. */
+    template <typename Weight>
+    static node* rebuild_weighted (node* s, Weight weight, double& average_depth) {
+        std::vector<node*> nodes;
+        std::vector<std::uint64_t> prefix { 0 };
+
+        for (s = minimum(s); s; s = increment(s)) {
+            nodes.push_back(s);
+            prefix.push_back(prefix.back() + weight(s));
+        }
+
+        /* Nodes are only relinked once we're done walking the old tree. */
+        for (auto p : nodes) {
+            p->m_parent = nullptr;
+            p->m_children = std::make_pair(nullptr, nullptr);
+        }
+
+        std::uint64_t weighted_depth = 0;
+        auto root = build_weighted(nodes, prefix, 0, nodes.size(), 1, weighted_depth);
+
+        average_depth = nodes.empty() ? 0.0
+                : static_cast<double>(weighted_depth) / prefix.back();
+        return root;
+    }
+
+    /* Rebuild the tree s into a balanced tree of the nodes for which keep(s)
+     * is true, and return its new root. keep(s) is called exactly once for
+     * each node, in order, before anything is relinked, so it may throw.
+     * Every other node is emptied of its links and passed to
+     * release(node*). Makes no comparisons, and takes O(n) time, where n
+     * counts the released nodes too. DOES modify the tree. */
+    template <typename Keep, typename Release>
+    static node* rebuild_filtered (node* s, Keep keep, Release release) {
+        std::vector<node*> nodes;
+        std::vector<node*> released;
+        for_each(s, [&] (node* p) {
+            (keep(p) ? nodes : released).push_back(p);
+        });
+
+        /* Nodes are only relinked once we're done walking the old tree. */
+        for (auto p : released) {
+            p->clear_links();
+            release(p);
+        }
+
+        return rebuild_sorted(nodes);
+    }
+
+    /* Call f(node*) with every node of the tree s, in order. Walks with a
+     * stack, rather than with increment(): climbing back up through parent
+     * pointers would touch most nodes a second time, long after they've
+     * left the cache. f must not relink anything. Does NOT modify the
+     * tree. */
+    template <typename F>
+    static void for_each (node* s, F f) {
+        std::vector<node*> stack;
+        for (;;) {
+            for (; s; s = s->left()) {
+                stack.push_back(s);
+            }
+            if (stack.empty()) {
+                break;
+            }
+            s = stack.back();
+            stack.pop_back();
+            auto right = s->right();
+            f(s);
+            s = right;
+        }
+    }
+
+    /* Forget this node's parent and children, when its whole tree is being
+     * taken apart anyway. */
+    void clear_links () {
+        m_parent = nullptr;
+        m_children = std::make_pair(nullptr, nullptr);
+    }
+
+    /* Link nodes, which must be in symmetric order and belong to no tree
+     * (though they may still have stale links), into a balanced tree, and
+     * return its root. Threads are left alone, so a threaded tree's nodes
+     * must already be threaded in order. */
+    static node* build_sorted (const std::vector<node*>& nodes) {
+        auto root = build_balanced(nodes, 0, nodes.size(), nullptr);
+        if (is_augmented<Aux>::value) {
+            update_all(root);
+        }
+        return root;
+    }
+
+    /* Link nodes, which must be in symmetric order and belong to no tree,
+     * in between the trees lhs and rhs, and return the new root. Every node
+     * of lhs must come before nodes, and every node of rhs after them.
+     * nodes are built into a balanced tree, with lhs and rhs hung off its
+     * ends, so nothing is splayed, and lhs and rhs end up no more than
+     * about log2 of the number of nodes deeper. Threads are left alone, as
+     * in build_sorted(). */
+    static node* splice (node* lhs, const std::vector<node*>& nodes, node* rhs) {
+        if (nodes.empty()) {
+            return join(lhs, rhs);
+        }
+
+        auto root = build_sorted(nodes);
+        auto first = minimum(root);
+        auto last = maximum(root);
+        first->attach_left(lhs);
+        last->attach_right(rhs);
+
+        if (is_augmented<Aux>::value) {
+            for (auto s : { first, last }) {
+                for (s = s->m_parent; s; s = s->m_parent) {
+                    s->update();
+                }
+            }
+        }
+        return root;
+    }
+
+    /* Same as build_sorted(), but thread the nodes from scratch as well. */
+    static node* rebuild_sorted (const std::vector<node*>& nodes) {
+        if (!nodes.empty()) {
+            thread_sorted(nodes, static_cast<Aux*>(nodes.front()));
+        }
+        return build_sorted(nodes);
+    }
+
+    /* Write every node of the tree s in pre-order, each preceded by a byte
+     * saying which children it has. Together with the node count, this is
+     * enough to rebuild the exact same shape. Does NOT modify the tree. */
+    static void save (node* s, std::ostream& output) {
+        std::vector<node*> stack;
+        if (s) {
+            stack.push_back(s);
+        }
+
+        while (!stack.empty()) {
+            s = stack.back();
+            stack.pop_back();
+
+            char children = (s->left() ? HAS_LEFT : 0) | (s->right() ? HAS_RIGHT : 0);
+            output.put(children);
+            serializer<value_type>::save(output, s->m_value);
+
+            /* Push the right child first, so the left subtree comes out
+             * first. */
+            if (s->right()) {
+                stack.push_back(s->right());
+            }
+            if (s->left()) {
+                stack.push_back(s->left());
+            }
+        }
+    }
+
+    /* Rebuild a tree of count nodes written by save(), and return its root.
+     * Takes O(count) time and performs no comparisons. Throws
+     * std::runtime_error if the input is truncated or malformed. */
+    static node* load (std::istream& input, size_t count) {
+        node* root = nullptr;
+
+        /* In pre-order, a node with a left child is immediately followed by
+         * that child. Otherwise, the next node is the right child of the
+         * most recent node still waiting for one. */
+        node* waiting_left = nullptr;
+        std::vector<node*> waiting_right;
+
+        /* Nodes are attached to their parents before their own children
+         * are, so augmented trees must recompute every node afterwards. */
+        std::vector<node*> loaded;
+
+        try {
+            for (size_t i = 0; i < count; ++i) {
+                /* Check each read before using what it read, so nothing
+                 * past the end of a truncated snapshot gets into a node. */
+                auto children = input.get();
+                if (std::istream::traits_type::eof() == children
+                        || (children & ~(HAS_LEFT | HAS_RIGHT))) {
+                    throw std::runtime_error("malformed splaytree snapshot");
+                }
+                auto value = serializer<value_type>::load(input);
+                if (!input) {
+                    throw std::runtime_error("malformed splaytree snapshot");
+                }
+                auto s = new node(std::move(value));
+
+                if (!root) {
+                    root = s;
+                }
+                else if (waiting_left) {
+                    waiting_left->attach_left(s);
+                }
+                else if (!waiting_right.empty()) {
+                    waiting_right.back()->attach_right(s);
+                    waiting_right.pop_back();
+                }
+                else {
+                    delete s;
+                    throw std::runtime_error("malformed splaytree snapshot");
+                }
+
+                waiting_left = (children & HAS_LEFT) ? s : nullptr;
+                if (children & HAS_RIGHT) {
+                    waiting_right.push_back(s);
+                }
+                if (is_augmented<Aux>::value) {
+                    loaded.push_back(s);
+                }
+            }
+
+            if (waiting_left || !waiting_right.empty()) {
+                throw std::runtime_error("malformed splaytree snapshot");
+            }
+
+            /* In reverse pre-order, children come before their parents. */
+            for (auto it = loaded.rbegin(); it != loaded.rend(); ++it) {
+                (*it)->update();
+            }
+
+            thread_all(root, static_cast<Aux*>(root));
+        }
+        catch (...) {
+            delete root;
+            throw;
+        }
+
+        return root;
+    }
+
+    /* Dump out an adjacency list of the tree, in pre-order. Uses an
+     * explicit stack, since the tree may be arbitrarily deep. */
+    void dump_structure () {
+        std::vector<node*> stack { this };
+        while (!stack.empty()) {
+            auto s = stack.back();
+            stack.pop_back();
+
+            std::cout << s->m_value << " | ";
+            if (s->left()) {
+                std::cout << s->left()->value() << ' ';
+            }
+            else {
+                std::cout << "(nil) ";
+            }
+
+            if (s->right()) {
+                std::cout << s->right()->value();
+            }
+            else {
+                std::cout << "(nil)";
+            }
+            std::cout << '\n';
+
+            if (s->right()) {
+                stack.push_back(s->right());
+            }
+            if (s->left()) {
+                stack.push_back(s->left());
+            }
+        }
+    }
+
+    /* Delete the subtree s. It may be arbitrarily deep, so rather than
+     * recursing, rotate left children up until the top node has none, then
+     * delete it and carry on with its right subtree. The nodes are all
+     * going away, so only their child links are kept straight. */
+    static void destroy_subtree (node* s) {
+        while (s) {
+            if (auto l = s->left()) {
+                s->left() = l->right();
+                l->right() = s;
+                s = l;
+            }
+            else {
+                auto r = s->right();
+                s->right() = nullptr;
+                delete s;
+                s = r;
+            }
+        }
+    }
+
+    /* Count the nodes of the tree s at each depth into histogram, which is
+     * grown as needed. Does NOT modify the tree. */
+    static void depth_histogram (node* s, std::vector<size_t>& histogram) {
+        std::vector<std::pair<node*, size_t>> stack;
+        if (s) {
+            stack.emplace_back(s, 0);
+        }
+
+        while (!stack.empty()) {
+            size_t depth;
+            std::tie(s, depth) = stack.back();
+            stack.pop_back();
+
+            if (histogram.size() <= depth) {
+                histogram.resize(depth + 1);
+            }
+            ++histogram[depth];
+
+            if (s->right()) {
+                stack.emplace_back(s->right(), depth + 1);
+            }
+            if (s->left()) {
+                stack.emplace_back(s->left(), depth + 1);
+            }
+        }
+    }
+
+    /* Visit the top max_depth + 1 levels of the subtree s in pre-order. f is
+     * called with each node, its pre-order number, its parent's number (the
+     * same as its own for s itself), which child of its parent it is (-1 for
+     * left, 1 for right, 0 for s), its depth below s, and whether it has
+     * children which were cut off. Does NOT modify the tree. */
+    template <typename F>
+    static void visit_top (node* s, size_t max_depth, F f) {
+        struct entry {
+            node* s;
+            size_t parent;
+            int side;
+            size_t depth;
+        };
+
+        std::vector<entry> stack;
+        if (s) {
+            stack.push_back(entry { s, 0, 0, 0 });
+        }
+
+        for (size_t id = 0; !stack.empty(); ++id) {
+            auto e = stack.back();
+            stack.pop_back();
+
+            auto has_children = e.s->left() || e.s->right();
+            auto cut = has_children && e.depth == max_depth;
+            f(e.s, id, e.side ? e.parent : id, e.side, e.depth, cut);
+
+            if (!cut) {
+                if (e.s->right()) {
+                    stack.push_back(entry { e.s->right(), id, 1, e.depth + 1 });
+                }
+                if (e.s->left()) {
+                    stack.push_back(entry { e.s->left(), id, -1, e.depth + 1 });
+                }
+            }
+        }
+    }
+
+    /* Compare value with a node's value, returning -1, 0, or 1, using a
+     * three-way comparison if comp supports it. */
+    template <typename Key, typename Compare>
+    static int compare (const Key& value, const value_type& other, const Compare& comp) {
+        return compare(value, other, comp, has_three_way<Compare, Key, value_type>());
+    }
+
+    template <typename Key, typename Compare>
+    static int compare (const Key& value, const value_type& other, const Compare& comp,
+                        std::true_type) {
+        return three_way(comp, value, other);
+    }
+
+    template <typename Key, typename Compare>
+    static int compare (const Key& value, const value_type& other, const Compare& comp,
+                        std::false_type) {
+        return comp(value, other) ? -1 : comp(other, value);
+    }
+
+private:
+    /* search_no_splay() for comparison objects which support three-way
+     * comparison. */
+    template <typename Key, typename Compare>
+    static node* search_no_splay (node* s, const Key& value, const Compare& comp,
+                                  int& order, size_t& depth, std::true_type) {
+        node* p = nullptr;
+        order = 0;
+        depth = 0;
+
+        while (s) {
+            p = s;
+            ++depth;
+            order = three_way(comp, value, s->m_value);
+            if (order < 0) {
+                s = s->left();
+            }
+            else if (order > 0) {
+                s = s->right();
+            }
+            else {
+                break;
+            }
+        }
+
+        return p;
+    }
+
+    /* search_no_splay() for comparison objects which only provide a
+     * less-than comparison. */
+    template <typename Key, typename Compare>
+    static node* search_no_splay (node* s, const Key& value, const Compare& comp,
+                                  int& order, size_t& depth, std::false_type) {
+        node* p = nullptr;
+        order = 0;
+        depth = 0;
+
+        while (s) {
+            p = s;
+            ++depth;
+            if (comp(value, s->m_value)) {
+                order = -1;
+                s = s->left();
+            }
+            else if (comp(s->m_value, value)) {
+                order = 1;
+                s = s->right();
+            }
+            else {
+                order = 0;
+                break;
+            }
+        }
+
+        return p;
+    }
+
+    /* Implementations of increment() and decrement() for unthreaded trees,
+     * which must climb the tree to find the next node.
+     * FIXME some code duplication between these two. */
+    static node* increment (node* s, const void*) {
         if (s->right()) {
             return minimum(s->right());
         }
@@ -244,13 +1512,7 @@ public:
         return s->m_parent;
     }
 
-    /* Traverse the tree to the previous node, in-order. Does NOT modify the
-     * tree. */
-    static node* decrement (node* s) {
-        if (!s) {
-            return nullptr;
-        }
-
+    static node* decrement (node* s, const void*) {
         if (s->left()) {
             return maximum(s->left());
         }
@@ -261,120 +1523,217 @@ public:
             s = s->m_parent;
         }
 
-        return s->m_parent;
+        return s->m_parent;
+    }
+
+    /* ... and for threaded trees, which simply follow the thread. */
+    static node* increment (node* s, thread_aux*) {
+        return static_cast<node*>(s->m_next);
+    }
+
+    static node* decrement (node* s, thread_aux*) {
+        return static_cast<node*>(s->m_prev);
+    }
+
+    /* ... and for trees with tombstones, which skip over dead nodes. */
+    static node* increment (node* s, tombstone_aux*) {
+        do {
+            s = increment(s, static_cast<const void*>(s));
+        } while (s && s->m_dead);
+        return s;
+    }
+
+    static node* decrement (node* s, tombstone_aux*) {
+        do {
+            s = decrement(s, static_cast<const void*>(s));
+        } while (s && s->m_dead);
+        return s;
     }
 
-    /* Return a pointer to the smallest node whose key is greater than or
-     * equal to the given value. Does NOT modify the tree. */
-    template <typename Compare>
-    static node* lower_bound_no_splay (node* s, const value_type& value, const Compare& comp) {
-        s = search_no_splay(s, value, comp);
+    static bool is_dead (const node*, const void*) { return false; }
+    static bool is_dead (const node* s, const tombstone_aux*) { return s->m_dead; }
 
-        if (!s) {
-            return nullptr;
-        }
+    /* Maintain the thread of a threaded tree as nodes come and go. */
+    void thread (node*, int, const void*) { }
 
-        /* If this node is less than the search key, then the search key was
-         * not found. The next node must be the first node that is not less
-         * than the search key. */
-        if (comp(s->value(), value)) {
-            return increment(s);
+    void thread (node* neighbor, int order, thread_aux*) {
+        if (order < 0) {
+            this->link_before(neighbor);
         }
-
-        /* This node is greater than or equal to the search key. Decrement
-         * until we find the first node that is not less than the search key.
-         */
-        auto p = s;
-        while (p && !comp(p->value(), value)) {
-            s = p;
-            p = decrement(p);
+        else {
+            this->link_after(neighbor);
         }
+    }
 
-        return s;
+    void unthread (const void*) { }
+
+    void unthread (thread_aux*) {
+        this->unlink();
     }
 
-    /* Same as lower_bound_no_splay, except the return value is also the new
-     * root of the tree, IF it is not null. If it is null, this simply means
-     * that the lower bound is past the end of the tree. DOES modify the tree.
-     */
-    template <typename Compare>
-    static node* lower_bound (node* s, const value_type& value, const Compare& comp) {
-        s = lower_bound_no_splay(s, value, comp);
+    /* Copy another node's auxiliary data when relocating it. A thread would
+     * still point at the old nodes, so threads are rebuilt instead. */
+    void copy_aux (const node& other, const void*) {
+        static_cast<Aux&>(*this) = static_cast<const Aux&>(other);
+    }
 
+    void copy_aux (const node&, thread_aux*) { }
+
+    /* Recompute the auxiliary data of every node in the tree s, children
+     * before parents. */
+    static void update_all (node* s) {
+        std::vector<std::pair<node*, bool>> stack;
         if (s) {
-            s->splay();
+            stack.emplace_back(s, false);
         }
 
-        return s;
+        while (!stack.empty()) {
+            auto& top = stack.back();
+            s = top.first;
+            if (top.second) {
+                stack.pop_back();
+                s->update();
+                continue;
+            }
+
+            top.second = true;
+            if (s->left()) {
+                stack.emplace_back(s->left(), false);
+            }
+            if (s->right()) {
+                stack.emplace_back(s->right(), false);
+            }
+        }
     }
 
-    /* Return a pointer to the smallest node whose key is greater than the 
-     * given value. Does NOT modify the tree. */
-    template <typename Compare>
-    static node* upper_bound_no_splay (node* s, const value_type& value, const Compare& comp) {
-        s = search_no_splay(s, value, comp);
+    /* Thread nodes, which are in symmetric order, to each other alone. */
+    static void thread_sorted (const std::vector<node*>&, const void*) { }
 
-        if (!s) {
-            return nullptr;
+    static void thread_sorted (const std::vector<node*>& nodes, thread_aux*) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            nodes[i]->m_prev = i ? nodes[i - 1] : nullptr;
+            nodes[i]->m_next = i + 1 < nodes.size() ? nodes[i + 1] : nullptr;
         }
+    }
 
-        if (comp(s->value(), value)) {
-            return increment(s);
-        }
+    /* Thread every node of the tree s, after building it without threads.
+     * Only used by load() and relocate(). */
+    static void thread_all (node*, const void*) { }
 
-        /* This node is greater than or equal to the search key. Increment
-         * until we find a node that is strictly greater. */
-        while (s && !comp(value, s->value())) {
-            s = increment(s);
+    static void thread_all (node* s, thread_aux*) {
+        node* prev = nullptr;
+        for (s = minimum(s); s; s = increment(s, static_cast<const void*>(s))) {
+            if (prev) {
+                s->link_after(prev);
+            }
+            prev = s;
         }
-
-        return s;
     }
 
-    /* Same as upper_bound_no_splay, except the return value is also the new
-     * root of the tree, IF it is not null. If it is null, this simply means
-     * that the upper bound is past the end of the tree. DOES modify the tree. */
-    template <typename Compare>
-    static node* upper_bound (node* s, const value_type& value, const Compare& comp) {
-        s = upper_bound_no_splay(s, value, comp);
-
-        if (s) {
-            s->splay();
+    /* Build a balanced tree out of the path nodes[lo, hi) for
+     * rebuild_path(), where nodes[middle] is the node the path led to. The
+     * subtrees hanging off the path are still attached to the path's nodes:
+     * the subtree just before nodes[i] is its left child if i <= middle, or
+     * else nodes[i - 1]'s right child. So each node's children are only
+     * replaced after both of its new subtrees, which may need them, are
+     * built. Recursion depth is about log2 of the path's length. */
+    static node* build_path (const std::vector<node*>& nodes, size_t middle,
+                             size_t lo, size_t hi) {
+        if (lo == hi) {
+            return lo <= middle ? nodes[lo]->left() : nodes[lo - 1]->right();
         }
 
+        auto mid = lo + (hi - lo) / 2;
+        auto lhs = build_path(nodes, middle, lo, mid);
+        auto rhs = build_path(nodes, middle, mid + 1, hi);
+
+        auto s = nodes[mid];
+        s->m_children = std::make_pair(nullptr, nullptr);
+        for (auto p : { lhs, rhs }) {
+            if (p) {
+                p->m_parent = nullptr;
+            }
+        }
+        s->attach_left(lhs);
+        s->attach_right(rhs);
         return s;
     }
 
-    /* Dump out an adjacency list of the tree. */
-    void dump_structure () {
-        std::cout << m_value << " | ";
-        if (left()) {
-            std::cout << left()->value() << ' ';
-        }
-        else {
-            std::cout << "(nil) ";
+    /* Build a weight-balanced tree out of nodes[lo, hi) for
+     * rebuild_weighted(), where prefix[i] is the total weight of the first i
+     * nodes. Each node's depth times its weight is added to weighted_depth.
+     * Recursion depth is bounded by about log2 of the total weight. */
+    static node* build_weighted (const std::vector<node*>& nodes,
+                                 const std::vector<std::uint64_t>& prefix,
+                                 size_t lo, size_t hi, size_t depth,
+                                 std::uint64_t& weighted_depth) {
+        if (lo == hi) {
+            return nullptr;
         }
 
-        if (right()) {
-            std::cout << right()->value();
-        }
-        else {
-            std::cout << "(nil)";
+        /* Find the smallest j in (lo, hi] with 2 * prefix[j] > middle. Then
+         * nodes[j - 1] is the node whose weight straddles the middle. Gallop
+         * from both ends until one of them brackets j. */
+        const auto middle = prefix[lo] + prefix[hi];
+        auto past_middle = [&] (size_t j) { return 2 * prefix[j] > middle; };
+
+        size_t first = lo + 1;
+        size_t last = hi;
+        for (size_t step = 1; ; step *= 2) {
+            if (lo + step >= hi || past_middle(lo + step)) {
+                first = lo + step / 2 + 1;
+                last = std::min(lo + step, hi);
+                break;
+            }
+            if (hi - step <= lo || !past_middle(hi - step)) {
+                first = std::max(hi - step, lo) + 1;
+                last = hi - step / 2;
+                break;
+            }
         }
-        std::cout << '\n';
 
-        if (left()) {
-            left()->dump_structure();
+        /* Binary search within the bracket. */
+        while (first < last) {
+            auto j = first + (last - first) / 2;
+            if (past_middle(j)) {
+                last = j;
+            }
+            else {
+                first = j + 1;
+            }
         }
-        if (right()) {
-            right()->dump_structure();
+
+        const auto r = first - 1;
+        auto s = nodes[r];
+        weighted_depth += depth * (prefix[r + 1] - prefix[r]);
+
+        s->attach_left(build_weighted(nodes, prefix, lo, r, depth + 1, weighted_depth));
+        s->attach_right(build_weighted(nodes, prefix, r + 1, hi, depth + 1, weighted_depth));
+        return s;
+    }
+
+    /* Build a balanced tree out of nodes[lo, hi) for build_sorted(),
+     * overwriting whatever links they had, and hang it from parent. */
+    static node* build_balanced (const std::vector<node*>& nodes, size_t lo, size_t hi,
+                                 node* parent) {
+        if (lo == hi) {
+            return nullptr;
         }
+
+        auto middle = lo + (hi - lo) / 2;
+        auto s = nodes[middle];
+        s->m_parent = parent;
+        s->left() = build_balanced(nodes, lo, middle, s);
+        s->right() = build_balanced(nodes, middle + 1, hi, s);
+        return s;
     }
 
-private:
     /* Use like so: std::get<LEFT>(m_children) = ... */
     enum child_tag { LEFT, RIGHT };
 
+    /* Flags written by save() before each node. */
+    enum child_flags { HAS_LEFT = 1, HAS_RIGHT = 2 };
+
     template <child_tag Child>
     void attach (node* other) {
         assert(!get<Child>());
@@ -384,6 +1743,7 @@ private:
             assert(!get<Child>()->m_parent);
             get<Child>()->m_parent = this;
         }
+        update();
     }
 
     template <child_tag Child>
@@ -394,6 +1754,7 @@ private:
             assert(other->m_parent == this);
             other->m_parent = nullptr;
         }
+        update();
         return other;
     }
 
@@ -429,6 +1790,10 @@ private:
         }
         m_parent = gparent;
         get<RS>()->m_parent = this;
+
+        /* Our old parent is now our child, so update it first. */
+        get<RS>()->update();
+        update();
     }
 
     /* Any given node can only rotate in one direction (or not at all, for the
@@ -445,10 +1810,11 @@ private:
     }
 
     /* Move this node into the root position, while maintaining the symmetric
-     * order of the tree as a whole. */
-    void splay () {
-        while (!this->is_root()) {
-            if (!m_parent->is_root()) {
+     * order of the tree as a whole. If top is given, stop instead when this
+     * node becomes top's child. */
+    void splay (node* top = nullptr) {
+        while (m_parent != top) {
+            if (m_parent->m_parent != top) {
                 if (this->is_left_child() == m_parent->is_left_child()) {
                     m_parent->rotate();
                 }
@@ -460,6 +1826,27 @@ private:
         }
     }
 
+    /* Recompute our auxiliary data after our value or children change. Only
+     * augmented trees have anything to recompute. */
+    void update () {
+        update(static_cast<Aux*>(this));
+    }
+
+    void update (const void*) { }
+
+    template <typename Monoid>
+    void update (monoid_aux<Monoid>*) {
+        const Monoid monoid {};
+        auto summary = monoid.lift(m_value);
+        if (left()) {
+            summary = monoid.combine(left()->m_summary, summary);
+        }
+        if (right()) {
+            summary = monoid.combine(summary, right()->m_summary);
+        }
+        this->m_summary = std::move(summary);
+    }
+
     /* Access this node's left child. */
     node*& left () {
         return get<LEFT>();
@@ -487,23 +1874,26 @@ private:
 //////////////////////////////////////////////////////////////////////////////
 
 /* iterator and const_iterator both use a shared implementation template,
- * iterator_tpl. */
-template <typename T, typename Base>
+ * iterator_tpl. They are parameterized on the node type, rather than the
+ * value type, because the node type also depends on the tree's auxiliary
+ * data. */
+template <typename Node, typename Base>
 struct iterator_tpl;
 
 /* TODO my splaytree iterators only support forward iteration. Bidirectional
  * iteration is possible, but would require some refactoring of node to
  * accomplish. */
-template <typename T>
-using iterator = iterator_tpl<T, std::iterator<std::forward_iterator_tag, T>>;
+template <typename Node>
+using iterator = iterator_tpl<Node, std::iterator<std::forward_iterator_tag,
+      typename Node::value_type>>;
 
-template <typename T>
-using const_iterator = iterator_tpl<T, std::iterator<std::forward_iterator_tag,
-      typename std::add_const<T>::type>>;
+template <typename Node>
+using const_iterator = iterator_tpl<Node, std::iterator<std::forward_iterator_tag,
+      typename std::add_const<typename Node::value_type>::type>>;
 
-template <typename T, typename Base>
+template <typename Node, typename Base>
 struct iterator_tpl : Base {
-    using node_type = node<T>;
+    using node_type = Node;
     
     using base_type = Base;
 
@@ -513,8 +1903,15 @@ struct iterator_tpl : Base {
     explicit iterator_tpl (node_type* node = nullptr) : m_node(node) { }
 
     /* We need to be able to implicitly convert an iterator into a
-     * const_iterator. */
-    iterator_tpl (const iterator<T>& other) : m_node(other.m_node) { }
+     * const_iterator. This is a template so that, for an iterator, it isn't
+     * the copy constructor, which would leave the implicit copy assignment
+     * deprecated. */
+    template <typename Other, typename = typename std::enable_if<
+              std::is_same<Other, iterator<Node>>::value>::type>
+    iterator_tpl (const Other& other) : m_node(other.m_node) { }
+
+    iterator_tpl (const iterator_tpl&) = default;
+    iterator_tpl& operator= (const iterator_tpl&) = default;
 
     bool operator== (const iterator_tpl& other) const {
         return m_node == other.m_node;
@@ -544,8 +1941,165 @@ struct iterator_tpl : Base {
 
 //////////////////////////////////////////////////////////////////////////////
 
+/* A single contiguous block of memory holding the nodes of a compacted
+ * splaytree (see splaytree::compact()). Nodes are constructed in it one
+ * after another, and destroyed individually as they are erased; the memory
+ * itself is only freed along with the arena. */
+template <typename Node>
+class node_arena {
+public:
+    explicit node_arena (size_t capacity)
+            : m_memory(static_cast<Node*>(::operator new(capacity * sizeof(Node))))
+            , m_capacity(capacity) { }
+
+    node_arena (const node_arena&) = delete;
+    node_arena& operator= (const node_arena&) = delete;
+
+    ~node_arena () {
+        assert(!m_live);
+        ::operator delete(m_memory);
+    }
+
+    template <typename... Args>
+    Node* construct (Args&&... args) {
+        assert(m_size < m_capacity);
+        auto s = new (m_memory + m_size) Node(std::forward<Args>(args)...);
+        ++m_size;
+        ++m_live;
+        return s;
+    }
+
+    /* Destroy a node of ours, which must have no children. */
+    void destroy (Node* s) {
+        assert(owns(s) && m_live);
+        s->~Node();
+        --m_live;
+    }
+
+    bool owns (const Node* s) const {
+        std::less<const Node*> less;
+        return !less(s, m_memory) && less(s, m_memory + m_size);
+    }
+
+    /* The number of nodes constructed here and not yet destroyed. */
+    size_t live () const { return m_live; }
+
+    /* The number of nodes there is room for. */
+    size_t capacity () const { return m_capacity; }
+
+private:
+    Node* m_memory;
+    size_t m_capacity;
+    size_t m_size = 0;
+    size_t m_live = 0;
+};
+
+/* An owning handle to a node which has been extracted from a splaytree, as
+ * in C++17's node handles. The node can be inserted into another splaytree
+ * with the same node type without allocating or copying its value. (Taking
+ * it out of a compacted tree may have, though: see splaytree::extract().)
+ * A node handle is either empty or owns exactly one node, and deletes it if
+ * it is never inserted anywhere. */
+template <typename Node>
+class node_handle {
+public:
+    using value_type = typename Node::value_type;
+
+    node_handle () = default;
+
+    node_handle (node_handle&& other) : m_node(other.m_node) {
+        other.m_node = nullptr;
+    }
+
+    node_handle& operator= (node_handle&& other) {
+        std::swap(m_node, other.m_node);
+        return *this;
+    }
+
+    ~node_handle () {
+        delete m_node;
+    }
+
+    bool empty () const { return !m_node; }
+    explicit operator bool () const { return !!m_node; }
+
+    /* The extracted element. Must not be called on an empty handle. */
+    value_type& value () const {
+        assert(m_node);
+        return m_node->value();
+    }
+
+    friend void swap (node_handle& lhs, node_handle& rhs) {
+        std::swap(lhs.m_node, rhs.m_node);
+    }
+
+private:
+    template <typename Base>
+    friend class ::splaytree::splaytree;
+
+    explicit node_handle (Node* node) : m_node(node) { }
+
+    /* Give up ownership of our node. */
+    Node* release () {
+        auto node = m_node;
+        m_node = nullptr;
+        return node;
+    }
+
+    Node* m_node = nullptr;
+};
+
+/* The result of inserting a node handle: where the element with its key
+ * is, whether the insertion took place, and, if it did not, the node we
+ * were given back again. */
+template <typename Iterator, typename NodeHandle>
+struct insert_return_type {
+    Iterator position;
+    bool inserted;
+    NodeHandle node;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+/* Access policies. With splay_access_tag, every lookup splays the element
+ * it finds to the root, as usual. With frequency_access_tag, lookups also
+ * count how often each element is accessed, and the tree can be rebuilt
+ * from those counts into a nearly optimal static tree (see access_base). */
+struct splay_access_tag {
+    using node_aux = empty_aux;
+};
+
+struct frequency_access_tag {
+    using node_aux = access_count_aux;
+};
+
+/* With threaded_access_tag, lookups splay as usual, but every node also
+ * links to its in-order neighbors, so that iterating takes constant time
+ * per step and never touches parent nodes. */
+struct threaded_access_tag : splay_access_tag {
+    using node_aux = thread_aux;
+};
+
+/* With augmented_access_tag, lookups splay as usual, but every node also
+ * keeps the monoid sum of its subtree, for fast range aggregates (see
+ * access_base). */
+template <typename Monoid>
+struct augmented_access_tag : splay_access_tag {
+    using node_aux = monoid_aux<Monoid>;
+};
+
+/* With lazy_erase_access_tag, lookups splay as usual, but erase() only
+ * marks the element dead, and the dead are removed together later (see
+ * access_base). */
+struct lazy_erase_access_tag : splay_access_tag {
+    using node_aux = tombstone_aux;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
 /* Base class for using a splaytree as a set. */
-template <typename T, typename Compare, typename InsTag>
+template <typename T, typename Compare, typename InsTag,
+          typename AccessTag = splay_access_tag>
 struct set_base {
     /* Derived is not actually used for set's base class, and is only provided
      * for symmetry with map_base. */
@@ -557,6 +2111,9 @@ struct set_base {
         using value_compare = key_compare;
 
         using insert_behavior_tag = InsTag;
+        using access_tag = AccessTag;
+
+        using node_type = node<value_type, typename AccessTag::node_aux>;
 
         /* const_iterator is the only iterator implemented, because a splaytree
          * is a model of a set: the key and the value are the same, and
@@ -574,8 +2131,8 @@ struct set_base {
          *  3
          * Best to avoid such horrors--if mutability is required, the user can
          * use const_cast. */
-        using iterator = detail::const_iterator<value_type>;
-        using const_iterator = detail::const_iterator<value_type>;
+        using iterator = detail::const_iterator<node_type>;
+        using const_iterator = detail::const_iterator<node_type>;
 
     protected:
         /* In a set, the key and the value are one and the same, so making a
@@ -588,8 +2145,64 @@ struct set_base {
     };
 };
 
+/* What an augmented map's at() and operator[] return: a stand-in for a
+ * reference to the mapped value. The sums which include an element must be
+ * recomputed whenever its mapped value changes, so assigning through this
+ * refreshes them afterwards. Otherwise it converts to a T&. */
+template <typename Tree, typename Iterator, typename T>
+class augmented_reference {
+public:
+    augmented_reference (Tree& tree, const Iterator& it) : m_tree(tree), m_it(it) { }
+
+    augmented_reference& operator= (const T& value) {
+        get() = value;
+        m_tree.refresh(m_it);
+        return *this;
+    }
+
+    augmented_reference& operator= (T&& value) {
+        get() = std::move(value);
+        m_tree.refresh(m_it);
+        return *this;
+    }
+
+    /* Assigning one element's mapped value to another's. */
+    augmented_reference& operator= (const augmented_reference& other) {
+        return *this = static_cast<const T&>(other.get());
+    }
+
+    augmented_reference (const augmented_reference&) = default;
+
+    operator T& () const { return get(); }
+
+    /* Changes made through this reference are not seen by the sums; call
+     * the tree's refresh() after making them. */
+    T& get () const { return m_it.m_node->value().second; }
+
+private:
+    Tree& m_tree;
+    Iterator m_it;
+};
+
+/* Chooses what a map's at() and operator[] return: a plain reference to
+ * the mapped value, except in an augmented tree. */
+template <typename Tree, typename Iterator, typename T, typename AccessTag>
+struct mapped_reference {
+    using type = T&;
+
+    static type make (Tree&, const Iterator& it) { return it.m_node->value().second; }
+};
+
+template <typename Tree, typename Iterator, typename T, typename Monoid>
+struct mapped_reference<Tree, Iterator, T, augmented_access_tag<Monoid>> {
+    using type = augmented_reference<Tree, Iterator, T>;
+
+    static type make (Tree& tree, const Iterator& it) { return type(tree, it); }
+};
+
 /* Base class for using a splaytree as a map. */
-template <typename Key, typename T, typename Compare, typename InsTag>
+template <typename Key, typename T, typename Compare, typename InsTag,
+          typename AccessTag = splay_access_tag>
 struct map_base {
     template <typename Derived>
     struct base {
@@ -599,6 +2212,9 @@ struct map_base {
         using value_type = std::pair<typename std::add_const<Key>::type, T>;
 
         using insert_behavior_tag = InsTag;
+        using access_tag = AccessTag;
+
+        using node_type = node<value_type, typename AccessTag::node_aux>;
 
         /* Class to create function objects which can compare the keys
          * embedded inside of two objects of type value_type. */
@@ -611,6 +2227,49 @@ struct map_base {
                 return m_comp(lhs.first, rhs.first);
             }
 
+            /* Compare a bare key against an element's key, so that lookups
+             * don't have to build a whole value_type just to search. */
+            bool operator() (const key_type& lhs, const value_type& rhs) const {
+                return m_comp(lhs, rhs.first);
+            }
+
+            bool operator() (const value_type& lhs, const key_type& rhs) const {
+                return m_comp(lhs.first, rhs);
+            }
+
+            /* If key_compare is transparent, it can also compare keys with
+             * other types, and so can we. */
+            template <typename K, typename C = Compare, typename = typename C::is_transparent>
+            bool operator() (const K& lhs, const value_type& rhs) const {
+                return m_comp(lhs, rhs.first);
+            }
+
+            template <typename K, typename C = Compare, typename = typename C::is_transparent>
+            bool operator() (const value_type& lhs, const K& rhs) const {
+                return m_comp(lhs.first, rhs);
+            }
+
+            /* Get the key to compare from an element, or a bare key. These
+             * must be declared before three_way() uses them in its return
+             * type. */
+            static const key_type& key_of (const value_type& value) {
+                return value.first;
+            }
+
+            template <typename K>
+            static const K& key_of (const K& key) {
+                return key;
+            }
+
+            /* Three-way comparison, only available if key_compare supports
+             * it. Either argument may be an element or a bare key. */
+            template <typename Lhs, typename Rhs>
+            auto three_way (const Lhs& lhs, const Rhs& rhs) const
+                    -> decltype(detail::three_way(std::declval<const Compare&>(),
+                                                  key_of(lhs), key_of(rhs))) {
+                return detail::three_way(m_comp, key_of(lhs), key_of(rhs));
+            }
+
         protected:
             /* Get the underlying key_compare object from this value_compare
              * object.
@@ -629,8 +2288,14 @@ struct map_base {
         /* A map can have mutable iterators, because they point to a
          * std::pair<const Key, T>. That is, the key is still const, and only the
          * mapped type may be changed. */
-        using iterator = detail::iterator<value_type>;
-        using const_iterator = detail::const_iterator<value_type>;
+        using iterator = detail::iterator<node_type>;
+        using const_iterator = detail::const_iterator<node_type>;
+
+        /* What at() and operator[] return. In an augmented map, this is an
+         * augmented_reference, so that m[key] = value keeps the sums up to
+         * date; otherwise, it is a mapped_type&. */
+        using mapped_reference = typename detail::mapped_reference<Derived, iterator,
+                mapped_type, AccessTag>::type;
 
         /* The at() function and operator[] implemented here use the
          * Curiously-Recurring Template Pattern to call down into the
@@ -639,22 +2304,38 @@ struct map_base {
 
         /* Get a reference to the element at the given key, throwing
          * std::out_of_range if the element does not exist. */
-        mapped_type& at (const key_type& key) {
+        mapped_reference at (const key_type& key) {
             auto self = static_cast<Derived*>(this);
 
             auto elem = self->find(key);
             if (self->end() == elem) {
                 throw std::out_of_range("element not in tree");
             }
-            return elem->second;
+            return mapped(elem);
         }
 
         /* No const version of at(), because it relies on find(), which is
          * non-const. TODO maybe provide a const version of find()? */
 
+        /* Insert an element with the given key and a mapped value constructed
+         * from args, unless the key already exists. Neither the key nor the
+         * mapped value is constructed if no insertion takes place, so with a
+         * transparent key_compare, key may be any type that key_compare can
+         * compare and key_type can be explicitly constructed from. */
+        template <typename K, typename... Args>
+        std::pair<iterator, bool> try_emplace (K&& key, Args&&... args) {
+            auto self = static_cast<Derived*>(this);
+
+            return self->find_or_insert(key, [&] {
+                return new typename Derived::node_type(std::piecewise_construct,
+                        std::forward_as_tuple(key_type(std::forward<K>(key))),
+                        std::forward_as_tuple(std::forward<Args>(args)...));
+            });
+        }
+
         /* Get a reference to the element at the given key, inserting it if it
          * does not already exist. */
-        mapped_type& operator[] (const key_type& key) {
+        mapped_reference operator[] (const key_type& key) {
             auto self = static_cast<Derived*>(this);
 
             auto elem = self->find(key);
@@ -663,12 +2344,12 @@ struct map_base {
                 std::tie(elem, success) = self->insert(make_value(key));
                 assert(success);
             }
-            return elem->second;
+            return mapped(elem);
         }
 
         /* Get a reference to the element at the given key, inserting it if it
          * does not already exist. */
-        mapped_type& operator[] (key_type&& key) {
+        mapped_reference operator[] (key_type&& key) {
             auto self = static_cast<Derived*>(this);
 
             auto elem = self->find(key);
@@ -678,10 +2359,15 @@ struct map_base {
                     = self->insert(make_value(std::forward<key_type>(key)));
                 assert(success);
             }
-            return elem->second;
+            return mapped(elem);
         }
 
     protected:
+        mapped_reference mapped (const iterator& elem) {
+            return detail::mapped_reference<Derived, iterator, mapped_type,
+                    AccessTag>::make(*static_cast<Derived*>(this), elem);
+        }
+
         static value_type make_value (const key_type& key) {
             return std::make_pair(key, mapped_type());
         }
@@ -697,6 +2383,230 @@ struct map_base {
 struct insert_unique_tag { };
 struct insert_equivalent_tag { };
 
+//////////////////////////////////////////////////////////////////////////////
+
+/* Base class providing the interface specific to an access policy, using
+ * the same Curiously-Recurring Template Pattern as map_base. The default
+ * policy has no interface of its own.
+ *
+ * Every access_base has a copy_settings(), which a splaytree's copy
+ * constructor calls to carry over the other tree's configuration, but none
+ * of the state that depends on its elements or shape. */
+template <typename Derived, typename AccessTag>
+struct access_base {
+protected:
+    void copy_settings (const access_base&) { }
+};
+
+/* With frequency_access_tag, each successful find() counts an access to
+ * the element it found. optimize() then rebuilds the tree into a nearly
+ * optimal binary search tree for those counts (see
+ * node::rebuild_weighted()), with the most frequently accessed elements at
+ * the top, and halves every count so that old accesses gradually matter
+ * less.
+ *
+ * Splaying would immediately start undoing that shape, so after a rebuild,
+ * find() stops splaying. We keep an eye on how deep lookups go, though, and
+ * if they start going noticeably deeper than the rebuild predicted, the
+ * access pattern must have drifted, and find() goes back to splaying until
+ * the next rebuild. Insertion and erasure always splay. */
+template <typename Derived>
+struct access_base<Derived, frequency_access_tag> {
+    /* Rebuild the tree from its access counts now. */
+    void optimize () {
+        static_cast<Derived*>(this)->rebuild_by_frequency();
+    }
+
+    /* Only count one in every period accesses. Sampling makes counting
+     * cheaper, and an access distribution that is stable over hours hardly
+     * needs every access counted. */
+    void set_sample_period (std::uint32_t period) {
+        assert(period);
+        m_sample_period = period;
+        m_sample_countdown = period;
+    }
+
+    /* Automatically optimize() after every period counted accesses. A period
+     * of zero, the default, means optimize() is only called by hand. */
+    void set_rebuild_period (size_t period) {
+        m_rebuild_period = period;
+    }
+
+    /* Return true if find() is not splaying because of a recent rebuild. */
+    bool splaying_paused () const {
+        return m_paused;
+    }
+
+protected:
+    /* The copy is built by insertion, so there are no counts and no
+     * rebuild to carry over, just the periods. */
+    void copy_settings (const access_base& other) {
+        m_sample_period = other.m_sample_period;
+        m_sample_countdown = other.m_sample_period;
+        m_rebuild_period = other.m_rebuild_period;
+    }
+
+    /* The number of lookups over which we average depths to detect drift,
+     * and how much deeper than predicted they may go before we resume
+     * splaying. */
+    static constexpr size_t drift_window = 1024;
+    static constexpr double drift_tolerance = 1.5;
+
+    /* Count an access to node s, and rebuild if it's time. */
+    template <typename Node>
+    void count_access (Node* s) {
+        if (--m_sample_countdown) {
+            return;
+        }
+        m_sample_countdown = m_sample_period;
+
+        if (std::numeric_limits<std::uint32_t>::max() != s->m_hits) {
+            ++s->m_hits;
+        }
+
+        if (m_rebuild_period && ++m_counted_since_rebuild >= m_rebuild_period) {
+            optimize();
+        }
+    }
+
+    /* Record the depth of a lookup made while splaying is paused. */
+    void note_depth (size_t depth) {
+        m_window_depth += depth;
+        if (++m_window_lookups < drift_window) {
+            return;
+        }
+
+        if (m_window_depth > drift_tolerance * m_expected_depth * drift_window + drift_window) {
+            m_paused = false;
+        }
+        m_window_lookups = 0;
+        m_window_depth = 0;
+    }
+
+    /* Reset our state after a rebuild which predicts an average lookup depth
+     * of expected_depth. */
+    void rebuilt (double expected_depth) {
+        m_paused = true;
+        m_expected_depth = expected_depth;
+        m_counted_since_rebuild = 0;
+        m_window_lookups = 0;
+        m_window_depth = 0;
+    }
+
+    std::uint32_t m_sample_period = 1;
+    std::uint32_t m_sample_countdown = 1;
+    size_t m_rebuild_period = 0;
+    size_t m_counted_since_rebuild = 0;
+
+    bool m_paused = false;
+    double m_expected_depth = 0;
+    size_t m_window_lookups = 0;
+    size_t m_window_depth = 0;
+};
+
+template <typename Derived>
+constexpr size_t access_base<Derived, frequency_access_tag>::drift_window;
+
+template <typename Derived>
+constexpr double access_base<Derived, frequency_access_tag>::drift_tolerance;
+
+/* With augmented_access_tag, every node keeps the monoid sum of its
+ * subtree up to date through every rotation, insertion, and erasure, so the
+ * sum over any range of keys is available in amortized O(log n) time,
+ * instead of the O(k) time it takes to iterate over k elements.
+ *
+ * Assigning a mapped value through at() or operator[] keeps the sums up to
+ * date (see augmented_reference). The tree cannot see other changes to an
+ * element, such as assignments through an iterator, or changes made in
+ * place through the reference's get(). If the monoid depends on the mapped
+ * value, call refresh() on the element after changing it. */
+template <typename Derived, typename Monoid>
+struct access_base<Derived, augmented_access_tag<Monoid>> {
+    using summary_type = typename Monoid::result_type;
+
+    /* Return the monoid sum of every element with a key in [lo, hi), in
+     * order, or the identity if there are none. This splays the bounds of
+     * the range to the top of the tree. */
+    template <typename Key>
+    summary_type aggregate (const Key& lo, const Key& hi) {
+        auto self = static_cast<Derived*>(this);
+        auto s = Derived::node_type::isolate(self->m_root,
+                Derived::make_value(lo), Derived::make_value(hi), self->m_comp);
+        return s ? s->m_summary : Monoid().identity();
+    }
+
+    /* Return the monoid sum of every element in the tree. */
+    summary_type aggregate () const {
+        auto self = static_cast<const Derived*>(this);
+        return self->m_root ? self->m_root->m_summary : Monoid().identity();
+    }
+
+    /* Recompute the sums which include the element at pos, after it was
+     * changed through an iterator. */
+    template <typename Iterator>
+    void refresh (const Iterator& pos) {
+        auto self = static_cast<Derived*>(this);
+        self->m_root = Derived::node_type::refresh(pos.m_node);
+    }
+
+protected:
+    void copy_settings (const access_base&) { }
+};
+
+/* With lazy_erase_access_tag, erase() costs no splaying at all: the element
+ * is only marked dead, and left where it is. Lookups and iterators skip dead
+ * elements, so they behave as if it were gone, and the hot part of the tree
+ * near the root is left alone. Once dead elements make up more than the
+ * purge threshold's share of the tree, they are all removed in a single
+ * O(n) pass, which also rebuilds the tree into a balanced one. A lookup
+ * which lands on a dead element is a miss, and leaves it be. Re-inserting
+ * its key brings it back to life in place, with the new value.
+ *
+ * An erased element's value is only destroyed when it is removed, so it
+ * may hold on to its resources for a while. Since the dead elements are
+ * still part of the tree's shape, save() refuses to write a tree with any;
+ * purge() first. */
+template <typename Derived>
+struct access_base<Derived, lazy_erase_access_tag> {
+    /* Remove every dead element now. */
+    void purge () {
+        static_cast<Derived*>(this)->purge_dead();
+    }
+
+    /* Purge once more than fraction of the tree's nodes are dead. Defaults
+     * to a quarter. Higher fractions make erasing cheaper, at the cost of
+     * more memory spent on the dead. */
+    void set_purge_threshold (double fraction) {
+        assert(fraction > 0 && fraction <= 1);
+        m_purge_threshold = fraction;
+    }
+
+    /* The number of erased elements still waiting to be purged. */
+    size_t dead_count () const {
+        return m_dead;
+    }
+
+protected:
+    /* Dead elements aren't copied, so neither is their count. */
+    void copy_settings (const access_base& other) {
+        m_purge_threshold = other.m_purge_threshold;
+    }
+
+    size_t m_dead = 0;
+    double m_purge_threshold = 0.25;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+/* A read-only stream buffer over a range of memory, such as a memory-mapped
+ * snapshot file. */
+struct memory_streambuf : std::streambuf {
+    memory_streambuf (const char* data, size_t size) {
+        auto p = const_cast<char*>(data);
+        setg(p, p, p + size);
+    }
+};
+
 } // namespace detail
 
 //////////////////////////////////////////////////////////////////////////////
@@ -705,7 +2615,10 @@ struct insert_equivalent_tag { };
  * class to get its configuration, and any pieces of interface uncommon to all
  * containers that it can emulate. */
 template <typename Base>
-class splaytree : public Base::template base<splaytree<Base>> {
+class splaytree
+        : public Base::template base<splaytree<Base>>
+        , public detail::access_base<splaytree<Base>,
+                typename Base::template base<splaytree<Base>>::access_tag> {
 public:
     using base_type = typename Base::template base<splaytree>;
 
@@ -717,7 +2630,7 @@ public:
     using reference = value_type&;
     using const_reference = const value_type&;
 
-    using node_type = detail::node<value_type>;
+    using node_type = typename base_type::node_type;
 
     using iterator = typename base_type::iterator;
     using const_iterator = typename base_type::const_iterator;
@@ -725,7 +2638,22 @@ public:
     using difference_type = ptrdiff_t;
     using size_type = size_t;
 
-    using insert_behavior_tag = typename base_type::insert_behavior_tag;
+    using insert_behavior_tag = typename base_type::insert_behavior_tag;
+    using access_tag = typename base_type::access_tag;
+
+    using access_base_type = detail::access_base<splaytree, access_tag>;
+
+    using node_handle = detail::node_handle<node_type>;
+    using insert_return_type = detail::insert_return_type<iterator, node_handle>;
+
+    /* Our base classes implement some of their interface in terms of our
+     * private members. */
+    friend base_type;
+    friend access_base_type;
+
+    /* merge() takes nodes directly out of other splaytrees. */
+    template <typename OtherBase>
+    friend class splaytree;
 
     /* Default constructor */
     explicit splaytree (const key_compare& comp = key_compare())
@@ -733,10 +2661,17 @@ public:
             , m_size(0)
             , m_root(nullptr) { }
 
-    /* Copy constructor */
+    /* Copy constructor. The copy gets other's elements, and its settings:
+     * the depth guard, and whatever its access policy has (see
+     * access_base::copy_settings()). It does not get other's shape, access
+     * counts, or compacted arena. */
     /* TODO think about exception safety here */
     splaytree (const splaytree& other)
-            : splaytree(other.begin(), other.end(), other.key_comp()) { }
+            : splaytree(other.key_comp()) {
+        access_base_type::copy_settings(other);
+        m_depth_guard = other.m_depth_guard;
+        insert(other.begin(), other.end());
+    }
 
     /* Move constructor */
     splaytree (splaytree&& other) : splaytree() {
@@ -756,7 +2691,7 @@ public:
             : splaytree(ilist.begin(), ilist.end(), comp) { }
 
     ~splaytree () {
-        delete m_root;
+        destroy_all(m_root);
     }
 
     void swap (splaytree& other) {
@@ -766,13 +2701,29 @@ public:
 
     friend void swap (splaytree& lhs, splaytree& rhs) {
         using std::swap;
+        swap(static_cast<access_base_type&>(lhs), static_cast<access_base_type&>(rhs));
         swap(lhs.m_comp, rhs.m_comp);
         swap(lhs.m_size, rhs.m_size);
         swap(lhs.m_root, rhs.m_root);
+        swap(lhs.m_arena, rhs.m_arena);
+        swap(lhs.m_depth_guard, rhs.m_depth_guard);
+    }
+
+    /* Erase every element for which pred(element) is true, and return the
+     * number erased. Erasing them one at a time would splay twice for each;
+     * this walks the tree once instead, and relinks the surviving nodes,
+     * which are neither copied nor moved, into a balanced tree. Takes O(n)
+     * time and makes no comparisons. If pred throws, the tree is left as it
+     * was. */
+    template <typename Predicate>
+    friend size_type erase_if (splaytree& tree, Predicate pred) {
+        return tree.erase_matching(pred);
     }
 
-    iterator begin () { return iterator(node_type::minimum(m_root)); }
-    const_iterator begin () const { return const_iterator(node_type::minimum(m_root)); }
+    iterator begin () { return iterator(node_type::live(node_type::minimum(m_root))); }
+    const_iterator begin () const {
+        return const_iterator(node_type::live(node_type::minimum(m_root)));
+    }
     const_iterator cbegin () const { return begin(); }
 
     iterator end () { return iterator(nullptr); }
@@ -823,7 +2774,7 @@ public:
         return *this = splaytree(ilist, m_comp);
     }
 
-    size_type size () const { return m_size; }
+    size_type size () const { return m_size - dead_nodes(access_tag()); }
 
     size_type max_size () const {
         return std::numeric_limits<size_type>::max();
@@ -831,7 +2782,7 @@ public:
 
     bool empty () const {
         assert(!!m_size == !!m_root);
-        return !m_root;
+        return !size();
     }
 
     key_compare key_comp () const {
@@ -893,11 +2844,7 @@ public:
 
     iterator erase (const_iterator pos) {
         assert(pos.m_node);
-
-        m_root = node_type::erase(pos++.m_node);
-        --m_size;
-
-        return iterator(pos.m_node);
+        return erase_node(pos.m_node, access_tag());
     }
 
     iterator erase (const_iterator first, const_iterator last) {
@@ -906,30 +2853,222 @@ public:
         }
         return iterator(last.m_node);
     }
+
+    /* Unlink the element at pos from the tree and return a handle which
+     * owns it. Normally nothing is copied or allocated. In a compacted tree,
+     * though, a node in the arena can't leave it, so its value is moved
+     * into a newly allocated node, which for a map copies the const key. If
+     * that throws, the tree is left as it was. */
+    node_handle extract (const_iterator pos) {
+        assert(pos.m_node);
+        return node_handle(take(pos.m_node));
+    }
+
+    /* Same as above, but for the element with the given key. Returns an
+     * empty handle if there is no such element. */
+    node_handle extract (const key_type& key) {
+        auto pos = find(key);
+        return end() == pos ? node_handle() : extract(pos);
+    }
+
+    /* Link an extracted node into this tree, unless an element with the
+     * same key is already here, in which case the handle is given back in
+     * the result. The handle's node itself is linked in, so nothing is
+     * copied or allocated. */
+    insert_return_type insert (node_handle&& handle) {
+        if (handle.empty()) {
+            return insert_return_type { end(), false, node_handle() };
+        }
+
+        int order;
+        if (end() == find_value(handle.value(), order)) {
+            auto position = insert_found(handle.release(), order).first;
+            return insert_return_type { position, true, node_handle() };
+        }
+        return insert_return_type { iterator(m_root), false, std::move(handle) };
+    }
+
+    /* All hints are ignored. */
+    iterator insert (const_iterator, node_handle&& handle) {
+        return insert(std::move(handle)).position;
+    }
+
+    /* Move every element of other whose key is not already in this tree
+     * into this tree, by relinking its node. Elements with keys already
+     * present stay in other. other may have a different comparison
+     * function, but must have the same node type. If other is compacted,
+     * the values in its arena are moved into newly allocated nodes instead,
+     * as by extract(), and if that throws, the element stays in other. */
+    template <typename OtherBase>
+    void merge (splaytree<OtherBase>& other) {
+        static_assert(std::is_same<node_type,
+                typename splaytree<OtherBase>::node_type>::value,
+                "merge() requires splaytrees with the same node type");
+
+        if (static_cast<void*>(&other) == static_cast<void*>(this)) {
+            return;
+        }
+
+        auto s = node_type::live(node_type::minimum(other.m_root));
+        while (s) {
+            /* Find the next node before s leaves other. */
+            auto next = node_type::increment(s);
+
+            int order;
+            if (end() == find_value(s->value(), order)) {
+                insert_found(other.take(s), order);
+            }
+            s = next;
+        }
+    }
+
+    template <typename OtherBase>
+    void merge (splaytree<OtherBase>&& other) {
+        merge(other);
+    }
+
+    /* Apply a batch of updates, each a std::pair of a batch_op and a
+     * value_type. insert adds the value unless its key is already present.
+     * upsert adds it, or else overwrites the element with its key (in a
+     * map, just the mapped value). erase removes the element with the
+     * value's key, if any (in a map, the mapped value is ignored). The
+     * updates must be sorted by key, at most one per key, or else
+     * std::invalid_argument is thrown before any is applied.
+     *
+     * A batch at least as large as the tree is merged with it in a single
+     * in-order pass, and the result rebuilt into a balanced tree, in
+     * O(n + m) time for n elements and m updates. A smaller batch is
+     * applied one run at a time instead, where a run is the updates that
+     * fall between two neighboring elements: the tree is split there, and
+     * the run's new elements are built into a balanced subtree which joins
+     * the two halves back together, in O(log n) amortized time per run. */
+    template <typename ForwardIt>
+    void apply_sorted_batch (ForwardIt first, ForwardIt last) {
+        if (first == last) {
+            return;
+        }
+        for (auto it = first, next = std::next(first); next != last; it = next++) {
+            if (!m_comp(it->second, next->second)) {
+                throw std::invalid_argument(
+                        "apply_sorted_batch() requires updates sorted by key, one per key");
+            }
+        }
+
+        /* A merge visits every element, where splicing costs only about
+         * log2(n / m) splay steps per run: a sorted batch splays its way
+         * along the tree much like a sequential scan does. Measured on
+         * trees of 1M and 4M random ints, merging only pays once the batch
+         * is about as large as the tree. */
+        if (static_cast<size_type>(std::distance(first, last)) >= m_size) {
+            merge_batch(first, last);
+        }
+        else {
+            splice_batch(first, last);
+        }
+    }
+
+    /* Look up every key in [first, last) at once, and write an iterator to
+     * the matching element, or end(), to out for each key, in the same
+     * order as the keys. Rather than one descent and one splay per key, the
+     * keys are sorted (unless they already are) and answered in a single
+     * walk of the tree, and only the deepest node the walk reached is
+     * splayed afterwards, which pays for the walk the same way a splay pays
+     * for a single find(). Duplicate keys are fine. */
+    template <typename InputIt, typename OutputIt>
+    OutputIt find_batch (InputIt first, InputIt last, OutputIt out) {
+        std::vector<node_type*> found;
+        search_batch(first, last, found);
+        for (auto s : found) {
+            *out++ = iterator(s);
+        }
+        return out;
+    }
+
+    /* Same as find_batch(), but write whether each key is present. */
+    template <typename InputIt, typename OutputIt>
+    OutputIt contains_batch (InputIt first, InputIt last, OutputIt out) {
+        std::vector<node_type*> found;
+        search_batch(first, last, found);
+        for (auto s : found) {
+            *out++ = !!s;
+        }
+        return out;
+    }
     
     void clear () {
-        delete m_root;
+        destroy_all(m_root);
         m_root = nullptr;
         m_size = 0;
+        forget_dead(access_tag());
+    }
+
+    /* Guard against the occasional very expensive search. A splay tree only
+     * bounds the amortized cost of its operations: after n insertions in
+     * increasing order, for example, the tree is a single path, and the next
+     * search for the smallest element visits all n nodes. With a guard
+     * factor c, whenever a search visits more than c * log2(size()) nodes,
+     * the path it took is rebuilt into a balanced tree before splaying, in
+     * time proportional to that same search. No later search can then take
+     * that path's length again. A factor of 0, the default, turns the guard
+     * off.
+     *
+     * The guarded searches are the ones which splay: find(), insert(),
+     * erase() of a value, and the non-const lower_bound(), upper_bound(), and
+     * equal_range(). The const overloads don't change the tree, so they
+     * can't fix it either, and neither can the finger searches, which
+     * don't start at the root. The setting is kept by copies. */
+    void set_depth_guard (double factor) {
+        assert(factor >= 0);
+        m_depth_guard = factor;
+    }
+
+    /* Move every element into one freshly allocated, contiguous block of
+     * memory, and free the old nodes. Long-lived trees which have seen many
+     * insertions and erasures end up with their nodes scattered all over
+     * the heap, which makes both searches and scans miss the cache. After
+     * compacting, nodes near the root are packed together (breadth-first
+     * order, the default), or neighboring elements are (in-order, better
+     * for scans). The shape of the tree does not change.
+     *
+     * The tree stays fully usable. New elements are allocated individually
+     * as usual, and erased elements' space in the block is only reclaimed
+     * by the next compact(), or once every element in the block is gone.
+     * Iterators and references to elements are invalidated. */
+    void compact (compact_order order = compact_order::breadth_first) {
+        /* Dead elements aren't worth moving. */
+        purge_dead();
+
+        std::unique_ptr<arena_type> arena;
+        if (m_root) {
+            arena.reset(new arena_type(m_size));
+            m_root = node_type::relocate(m_root, compact_order::in_order == order,
+                    [&] (value_type&& value) { return arena->construct(std::move(value)); },
+                    [&] (node_type* s) { destroy(s); });
+        }
+        m_arena = std::move(arena);
     }
 
     /* Return an iterator to the element matching the given key, or an end()
      * iterator if the key is not found. */
     iterator find (const key_type& key) {
-        return find_value(base_type::make_value(key));
+        return find_key(key, access_tag());
     }
 
-    size_type count (const key_type& key) {
-        auto value = base_type::make_value(key);
+    /* Heterogeneous lookup, as in C++14's std::map: only available if
+     * key_compare is transparent. */
+    template <typename K, typename C = key_compare, typename = typename C::is_transparent>
+    iterator find (const K& key) {
+        return find_key(key, access_tag());
+    }
 
-        auto range = equal_range(value);
+    size_type count (const key_type& key) {
+        auto range = equal_range(key);
         return std::distance(range.first, range.second);
     }
 
     std::pair<iterator, iterator>
     equal_range (const key_type& key) {
-        auto value = base_type::make_value(key);
-        return std::make_pair(lower_bound(value), upper_bound(value));
+        return std::make_pair(lower_bound(key), upper_bound(key));
     }
 
     /* Return an iterator to the smallest element greater than or equal to the
@@ -937,6 +3076,7 @@ public:
     iterator lower_bound (const key_type& key) {
         auto value = base_type::make_value(key);
 
+        guard_search(value);
         auto bound = node_type::lower_bound(m_root, value, m_comp);
         
         if (!bound) {
@@ -944,7 +3084,7 @@ public:
         }
 
         m_root = bound;
-        return iterator(bound);
+        return iterator(node_type::live(bound));
     }
 
     /* Return an iterator to the smallest element greater than the given
@@ -952,6 +3092,7 @@ public:
     iterator upper_bound (const key_type& key) {
         auto value = base_type::make_value(key);
 
+        guard_search(value);
         auto bound = node_type::upper_bound(m_root, value, m_comp);
 
         if (!bound) {
@@ -959,29 +3100,128 @@ public:
         }
 
         m_root = bound;
-        return iterator(bound);
+        return iterator(node_type::live(bound));
+    }
+
+    /* Finger search: return an iterator to the element matching the given
+     * key, or end() if the key is not found, starting the search from the
+     * element at finger rather than from the root. If consecutive lookups
+     * are near each other in key order, passing the previous result as the
+     * finger makes each lookup take amortized O(log d) time, where d is the
+     * number of elements between the finger and the key. Like find(), this
+     * splays. If finger is end(), this is the same as find(). */
+    iterator find_near (const_iterator finger, const key_type& key) {
+        if (!finger.m_node) {
+            return find(key);
+        }
+
+        int order;
+        m_root = node_type::search_from(finger.m_node, key, m_comp, order);
+        return order || node_type::is_dead(m_root) ? iterator(nullptr) : iterator(m_root);
+    }
+
+    /* Finger search version of lower_bound(). */
+    iterator lower_bound_near (const_iterator finger, const key_type& key) {
+        if (!finger.m_node) {
+            return lower_bound(key);
+        }
+
+        auto bound = node_type::lower_bound_from(finger.m_node, key, m_comp);
+
+        if (!bound) {
+            return iterator(nullptr);
+        }
+
+        m_root = bound;
+        return iterator(node_type::live(bound));
     }
 
     size_type count (const key_type& key) const {
-        auto value = base_type::make_value(key);
-        auto range = equal_range(value);
+        auto range = equal_range(key);
         return std::distance(range.first, range.second);
     }
 
     std::pair<const_iterator, const_iterator>
     equal_range (const key_type& key) const {
-        auto value = base_type::make_value(key);
-        return std::make_pair(lower_bound(value), upper_bound(value));
+        return std::make_pair(lower_bound(key), upper_bound(key));
     }
 
     const_iterator lower_bound (const key_type& key) const {
         auto value = base_type::make_value(key);
-        return const_iterator(node_type::lower_bound_no_splay(m_root, value, m_comp));
+        return const_iterator(node_type::live(
+                node_type::lower_bound_no_splay(m_root, value, m_comp)));
     }
 
     const_iterator upper_bound (const key_type& key) const {
         auto value = base_type::make_value(key);
-        return const_iterator(node_type::upper_bound_no_splay(m_root, value, m_comp));
+        return const_iterator(node_type::live(
+                node_type::upper_bound_no_splay(m_root, value, m_comp)));
+    }
+
+    /* Write a snapshot of this tree to output. The snapshot records the
+     * tree's current shape as well as its elements, so a tree loaded from it
+     * keeps whatever frequently-accessed elements were near the root. The
+     * elements are written with serializer<value_type>. The format is:
+     *
+     *   "SPLY"              4-byte magic number
+     *   version             std::uint32_t, currently 1
+     *   count               std::uint64_t, the number of elements
+     *   count nodes         in pre-order, each a byte of child flags (1 =
+     *                       has a left child, 2 = has a right child)
+     *                       followed by the serialized element
+     *
+     * Integers are written in native byte order. Does NOT modify the tree.
+     * Throws std::logic_error if the tree holds erased elements which have
+     * not been purged yet (see lazy_erase_access_tag). */
+    void save (std::ostream& output) const {
+        if (dead_nodes(access_tag())) {
+            throw std::logic_error("cannot save a splaytree with unpurged elements");
+        }
+
+        const std::uint32_t version = snapshot_version;
+        const std::uint64_t count = m_size;
+
+        output.write(snapshot_magic, sizeof(snapshot_magic));
+        output.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        output.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        node_type::save(m_root, output);
+    }
+
+    /* Replace the contents of this tree with a snapshot written by save().
+     * This takes linear time and performs no comparisons, so the snapshot
+     * must have been written by a tree with an equivalent key_compare.
+     * Throws std::runtime_error if the snapshot is malformed, in which case
+     * this tree is left unchanged. */
+    void load (std::istream& input) {
+        char magic[sizeof(snapshot_magic)];
+        std::uint32_t version;
+        std::uint64_t count;
+
+        input.read(magic, sizeof(magic));
+        input.read(reinterpret_cast<char*>(&version), sizeof(version));
+        input.read(reinterpret_cast<char*>(&count), sizeof(count));
+
+        if (!input || !std::equal(magic, magic + sizeof(magic), snapshot_magic)) {
+            throw std::runtime_error("not a splaytree snapshot");
+        }
+        if (snapshot_version != version) {
+            throw std::runtime_error("unsupported splaytree snapshot version");
+        }
+
+        auto root = node_type::load(input, count);
+
+        destroy_all(m_root);
+        m_root = root;
+        m_size = count;
+        forget_dead(access_tag());
+    }
+
+    /* Same as load(std::istream&), but reads the snapshot directly out of
+     * memory, e.g., a memory-mapped snapshot file. */
+    void load (const char* data, size_t size) {
+        detail::memory_streambuf buffer { data, size };
+        std::istream input { &buffer };
+        load(input);
     }
 
     void dump_structure () {
@@ -993,24 +3233,142 @@ public:
         }
     }
 
+    /* Measure the depth of every node. Takes linear time, and does NOT
+     * modify the tree. */
+    tree_shape shape_stats () const {
+        tree_shape shape;
+        node_type::depth_histogram(m_root, shape.depth_histogram);
+
+        size_t total_depth = 0;
+        for (size_t d = 0; d < shape.depth_histogram.size(); ++d) {
+            total_depth += d * shape.depth_histogram[d];
+        }
+
+        shape.size = m_size;
+        shape.height = shape.depth_histogram.size();
+        shape.average_depth = m_size ? static_cast<double>(total_depth) / m_size : 0;
+        return shape;
+    }
+
+    /* Measure how much memory this tree uses. The values' own heap memory
+     * is counted with heap_usage<value_type>, which for most value types
+     * means visiting every element; otherwise this takes constant time. */
+    memory_footprint memory_usage () const {
+        memory_footprint usage;
+        usage.node_bytes = m_size * sizeof(node_type);
+
+        for (auto& value : *this) {
+            usage.heap_bytes += heap_usage<value_type>::bytes(value);
+        }
+
+        auto pooled = m_arena ? m_arena->live() : 0;
+        auto per_node = detail::allocation_size(sizeof(node_type)) - sizeof(node_type);
+        usage.overhead_bytes = (m_size - pooled) * per_node;
+        if (m_arena) {
+            usage.overhead_bytes += (m_arena->capacity() - pooled) * sizeof(node_type)
+                    + detail::allocation_size(0);
+        }
+        return usage;
+    }
+
+    /* Write the top max_depth + 1 levels of the subtree rooted at the given
+     * element as a Graphviz digraph. Nodes with children below the cutoff
+     * get a dashed edge to a "..." node. Each node is labeled by calling
+     * label(output, value) into a string; by default, with the element (or
+     * for maps, its key) written with operator<<. Written as we go, without
+     * recursion, so huge and degenerate trees are fine. Does NOT modify the
+     * tree. */
+    template <typename Labeler = detail::default_labeler>
+    void write_graphviz (std::ostream& output, const_iterator subtree,
+                         size_t max_depth = 8, Labeler label = Labeler()) const {
+        std::ostringstream text;
+        output << "digraph splaytree {\n";
+        node_type::visit_top(subtree.m_node, max_depth,
+                [&] (node_type* s, size_t id, size_t parent, int side, size_t, bool cut) {
+                    text.str(std::string());
+                    label(text, s->value());
+                    output << "  n" << id << " [label=\"";
+                    detail::write_quoted(output, text.str(), false);
+                    output << "\"];\n";
+                    if (side) {
+                        output << "  n" << parent << " -> n" << id
+                               << (side < 0 ? " [label=L];\n" : " [label=R];\n");
+                    }
+                    if (cut) {
+                        output << "  n" << id << "_more [label=\"...\", shape=plaintext];\n"
+                               << "  n" << id << " -> n" << id << "_more [style=dashed];\n";
+                    }
+                });
+        output << "}\n";
+    }
+
+    /* Same as above, for the whole tree. */
+    void write_graphviz (std::ostream& output, size_t max_depth = 8) const {
+        write_graphviz(output, const_iterator(m_root), max_depth);
+    }
+
+    /* Same as write_graphviz(), but writes a JSON object holding a flat
+     * array of nodes in pre-order, each like:
+     *
+     *   {"id":1,"parent":0,"side":"left","depth":1,"label":"3","cut":false}
+     *
+     * "parent" and "side" are null for the subtree's root, and "cut" is true
+     * for nodes whose children were cut off. */
+    template <typename Labeler = detail::default_labeler>
+    void write_json (std::ostream& output, const_iterator subtree,
+                     size_t max_depth = 8, Labeler label = Labeler()) const {
+        std::ostringstream text;
+        const char* separator = "\n";
+        output << "{\"nodes\":[";
+        node_type::visit_top(subtree.m_node, max_depth,
+                [&] (node_type* s, size_t id, size_t parent, int side, size_t depth, bool cut) {
+                    text.str(std::string());
+                    label(text, s->value());
+                    output << separator << "{\"id\":" << id << ",\"parent\":";
+                    if (side) {
+                        output << parent << (side < 0 ? ",\"side\":\"left\"" : ",\"side\":\"right\"");
+                    }
+                    else {
+                        output << "null,\"side\":null";
+                    }
+                    output << ",\"depth\":" << depth << ",\"label\":\"";
+                    detail::write_quoted(output, text.str(), true);
+                    output << "\",\"cut\":" << (cut ? "true" : "false") << '}';
+                    separator = ",\n";
+                });
+        output << "\n]}\n";
+    }
+
+    /* Same as above, for the whole tree. */
+    void write_json (std::ostream& output, size_t max_depth = 8) const {
+        write_json(output, const_iterator(m_root), max_depth);
+    }
+
 private:
+    static constexpr const char snapshot_magic[4] = { 'S', 'P', 'L', 'Y' };
+    static constexpr std::uint32_t snapshot_version = 1;
+
     /* Auxiliary function called by insert() to reduce code duplication.
      * Preconditions: newroot is the newly created element to be inserted, and
      * the tree has been arranged such that the correct place for the new root
-     * node is between the current root and one of its children. */
-    std::pair<iterator,bool> insert_aux (node_type* newroot) {
+     * node is between the current root and one of its children, and order is
+     * the result of comparing the new value with the current root's (as set
+     * by find_value()). */
+    std::pair<iterator,bool> insert_aux (node_type* newroot, int order) {
         assert(newroot);
 
         node_type* lhs = nullptr;
         node_type* rhs = nullptr;
 
         if (m_root) {
-            if (m_comp(newroot->value(), m_root->value())) {
+            node_type::thread(newroot, m_root, order);
+
+            if (order < 0) {
                 lhs = m_root->detach_left();
                 rhs = m_root;
             }
             else {
-                assert(m_comp(m_root->value(), newroot->value()));
+                assert(order > 0);
                 lhs = m_root;
                 rhs = m_root->detach_right();
             }
@@ -1025,10 +3383,22 @@ private:
         return std::make_pair(iterator(m_root), true);
     }
 
-    iterator find_value (const value_type& value) {
-        m_root = node_type::search(m_root, value, m_comp);
+    /* Splay the node matching value to the root and return an iterator to
+     * it, or end() if no such node exists. The value may be any type which
+     * m_comp can compare against a value_type. order is set to the result of
+     * comparing value with the new root's value, as in node::search(). In a
+     * tree with tombstones, a dead match also gives end(), with order set to
+     * 0 and the dead node at the root, where an insertion can revive it. */
+    template <typename Value>
+    iterator find_value (const Value& value, int& order) {
+        if (m_depth_guard) {
+            m_root = node_type::search(m_root, value, m_comp, order, max_search_depth());
+        }
+        else {
+            m_root = node_type::search(m_root, value, m_comp, order);
+        }
 
-        if (!m_root || m_comp(value, m_root->value()) || m_comp(m_root->value(), value)) {
+        if (!m_root || order || node_type::is_dead(m_root)) {
             /* Not found. */
             return iterator(nullptr);
         }
@@ -1036,13 +3406,492 @@ private:
         return iterator(m_root);
     }
 
+    /* Link newroot into the tree where find_value() came up empty: next to
+     * the root, as insert_aux() does, or, if the root is a dead node with
+     * the same key, in its place. */
+    std::pair<iterator, bool> insert_found (node_type* newroot, int order) {
+        if (m_root && !order) {
+            replace_dead_root(newroot, access_tag());
+            return std::make_pair(iterator(m_root), true);
+        }
+        return insert_aux(newroot, order);
+    }
+
+    /* Same, for a value rather than a node: a dead root is revived in
+     * place, by assigning it the value. */
+    template <typename Value>
+    std::pair<iterator, bool> insert_found_value (Value&& value, int order) {
+        if (m_root && !order) {
+            assign_value(m_root->value(), value);
+            revive(m_root, access_tag());
+            return std::make_pair(iterator(m_root), true);
+        }
+        return insert_aux(new node_type(std::forward<Value>(value)), order);
+    }
+
+    template <typename Value>
+    iterator find_value (const Value& value) {
+        int order;
+        return find_value(value, order);
+    }
+
+    /* Implementations of find() for each access policy. */
+    template <typename Key>
+    iterator find_key (const Key& key, detail::splay_access_tag) {
+        return find_value(key);
+    }
+
+    template <typename Key>
+    iterator find_key (const Key& key, detail::frequency_access_tag) {
+        int order;
+        node_type* s;
+
+        if (this->m_paused) {
+            size_t depth;
+            s = node_type::search_no_splay(m_root, key, m_comp, order, depth);
+            this->note_depth(depth);
+        }
+        else {
+            s = m_root = node_type::search(m_root, key, m_comp, order);
+        }
+
+        if (!s || order) {
+            return iterator(nullptr);
+        }
+
+        this->count_access(s);
+        return iterator(s);
+    }
+
+    /* Look up each key in [first, last), setting found[i] to the node
+     * matching the i-th key, or nullptr. Used by find_batch() and
+     * contains_batch(). */
+    template <typename InputIt>
+    void search_batch (InputIt first, InputIt last, std::vector<node_type*>& found) {
+        std::vector<key_type> keys(first, last);
+        found.assign(keys.size(), nullptr);
+
+        /* Sort positions in keys, rather than the keys themselves, so we
+         * know where each answer goes. */
+        std::vector<size_t> order(keys.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+
+        auto key_comp = this->key_comp();
+        if (!std::is_sorted(keys.begin(), keys.end(), key_comp)) {
+            std::stable_sort(order.begin(), order.end(), [&] (size_t lhs, size_t rhs) {
+                return key_comp(keys[lhs], keys[rhs]);
+            });
+        }
+
+        /* Walk the tree with the keys in sorted order. */
+        std::vector<key_type> sorted;
+        sorted.reserve(keys.size());
+        for (auto i : order) {
+            sorted.push_back(std::move(keys[i]));
+        }
+
+        auto deepest = node_type::search_sorted(m_root, sorted.cbegin(), sorted.cend(), m_comp,
+                [&] (typename std::vector<key_type>::const_iterator it, node_type* s) {
+                    found[order[it - sorted.cbegin()]] = node_type::is_dead(s) ? nullptr : s;
+                });
+
+        if (deepest) {
+            splay_after_batch(deepest, access_tag());
+        }
+    }
+
+    /* Splay the deepest node reached by a batch lookup, unless the access
+     * policy says not to. */
+    void splay_after_batch (node_type* s, detail::splay_access_tag) {
+        m_root = node_type::splay_to_root(s);
+    }
+
+    void splay_after_batch (node_type* s, detail::frequency_access_tag) {
+        if (!this->m_paused) {
+            m_root = node_type::splay_to_root(s);
+        }
+    }
+
+    /* Implementations of erase() for each access policy. */
+    template <typename Tag>
+    iterator erase_node (node_type* s, Tag) {
+        auto next = node_type::increment(s);
+        m_root = node_type::extract(s);
+        destroy(s);
+        --m_size;
+        return iterator(next);
+    }
+
+    iterator erase_node (node_type* s, detail::lazy_erase_access_tag) {
+        s->m_dead = true;
+        ++this->m_dead;
+        auto next = node_type::increment(s);
+
+        /* next is alive, so it survives the purge. */
+        if (this->m_dead > this->m_purge_threshold * m_size) {
+            purge_dead();
+        }
+        return iterator(next);
+    }
+
+    /* The number of dead nodes in the tree, which only trees with
+     * tombstones have. */
+    template <typename Tag>
+    size_type dead_nodes (Tag) const { return 0; }
+
+    size_type dead_nodes (detail::lazy_erase_access_tag) const { return this->m_dead; }
+
+    template <typename Tag>
+    void forget_dead (Tag) { }
+
+    void forget_dead (detail::lazy_erase_access_tag) { this->m_dead = 0; }
+
+    /* Put s in place of the dead node at the root, which has the same key,
+     * and free the dead one. Only trees with tombstones have any. */
+    template <typename Tag>
+    void replace_dead_root (node_type*, Tag) {
+        assert(false);
+    }
+
+    void replace_dead_root (node_type* s, detail::lazy_erase_access_tag) {
+        auto dead = m_root;
+        auto lhs = dead->detach_left();
+        auto rhs = dead->detach_right();
+        destroy(dead);
+        --this->m_dead;
+
+        m_root = s;
+        m_root->attach_left(lhs);
+        m_root->attach_right(rhs);
+    }
+
+    /* Overwrite an element with an update for the same key. In a map, only
+     * the mapped value can change. */
+    template <typename K, typename V>
+    static void assign_value (std::pair<const K, V>& lhs, const std::pair<const K, V>& rhs) {
+        lhs.second = rhs.second;
+    }
+
+    template <typename V>
+    static void assign_value (V& lhs, const V& rhs) {
+        lhs = rhs;
+    }
+
+    /* Bring a dead node back to life. Only trees with tombstones have any. */
+    template <typename Tag>
+    void revive (node_type*, Tag) {
+        assert(false);
+    }
+
+    void revive (node_type* s, detail::lazy_erase_access_tag) {
+        s->m_dead = false;
+        --this->m_dead;
+    }
+
+    /* Apply the update *first to the node s with the same key. Returns
+     * true if s stays in the tree. */
+    template <typename ForwardIt>
+    bool apply_update (node_type* s, ForwardIt first) {
+        auto dead = node_type::is_dead(s);
+        if (batch_op::erase == first->first) {
+            return dead;
+        }
+        if (batch_op::upsert == first->first || dead) {
+            assign_value(s->value(), first->second);
+        }
+        if (dead) {
+            revive(s, access_tag());
+        }
+        return true;
+    }
+
+    /* Implementations of apply_sorted_batch(). merge_batch() only relinks
+     * nodes once it has walked the whole tree, so if allocating a node
+     * throws, the tree keeps its old shape, though upserts may already have
+     * been applied. */
+    template <typename ForwardIt>
+    void merge_batch (ForwardIt first, ForwardIt last) {
+        std::vector<node_type*> merged;
+        std::vector<node_type*> released;
+        std::vector<node_type*> fresh;
+        merged.reserve(m_size + std::distance(first, last));
+
+        /* Add the new elements for every update before position. */
+        auto insert_until = [&] (const ForwardIt& position) {
+            for (; first != position; ++first) {
+                if (batch_op::erase != first->first) {
+                    fresh.push_back(new node_type(first->second));
+                    merged.push_back(fresh.back());
+                }
+            }
+        };
+
+        try {
+            node_type::for_each(m_root, [&] (node_type* p) {
+                auto position = first;
+                int order = -1;
+                while (position != last
+                        && (order = node_type::compare(position->second, p->value(), m_comp)) < 0) {
+                    ++position;
+                }
+                insert_until(position);
+
+                auto keep = !node_type::is_dead(p);
+                if (first != last && !order) {
+                    keep = apply_update(p, first++) && !node_type::is_dead(p);
+                }
+
+                /* Dead nodes are purged along the way. */
+                (keep ? merged : released).push_back(p);
+            });
+            insert_until(last);
+        }
+        catch (...) {
+            for (auto p : fresh) {
+                delete p;
+            }
+            throw;
+        }
+
+        for (auto p : released) {
+            p->clear_links();
+            destroy(p);
+        }
+
+        m_root = node_type::rebuild_sorted(merged);
+        m_size = merged.size();
+        forget_dead(access_tag());
+    }
+
+    template <typename ForwardIt>
+    void splice_batch (ForwardIt first, ForwardIt last) {
+        std::vector<node_type*> run;
+        while (first != last) {
+            /* Split the tree just before the run, at the first node not
+             * less than its first key. rhs is that node, if any, and the
+             * run is every update up to its key. This is a plain search
+             * rather than lower_bound, which would step past a dead node
+             * with the very key we're after. */
+            node_type* lhs = m_root;
+            node_type* rhs = nullptr;
+            if (m_root) {
+                int order;
+                m_root = node_type::search(m_root, first->second, m_comp, order);
+                if (order > 0) {
+                    lhs = m_root;
+                    rhs = lhs->detach_right();
+                    if (rhs) {
+                        rhs = node_type::splay_to_root(node_type::minimum(rhs));
+                    }
+                }
+                else {
+                    rhs = m_root;
+                    lhs = rhs->detach_left();
+                }
+            }
+
+            /* The run's new nodes go between lhs's maximum and rhs. */
+            auto neighbor = rhs;
+            int side = -1;
+            if (!rhs) {
+                neighbor = node_type::maximum(lhs);
+                side = 1;
+            }
+
+            run.clear();
+            try {
+                for (; first != last; ++first) {
+                    auto order = rhs ? node_type::compare(first->second, rhs->value(), m_comp) : -1;
+                    if (order > 0) {
+                        break;
+                    }
+                    if (!order) {
+                        if (!apply_update(rhs, first)) {
+                            auto p = rhs;
+                            rhs = node_type::extract(p);
+                            destroy(p);
+                            --m_size;
+                        }
+                        else {
+                            node_type::refresh(rhs);
+                        }
+                        ++first;
+                        break;
+                    }
+                    if (batch_op::erase != first->first) {
+                        auto p = new node_type(first->second);
+                        if (neighbor) {
+                            node_type::thread(p, neighbor, side);
+                        }
+                        if (side > 0) {
+                            neighbor = p;
+                        }
+                        run.push_back(p);
+                        ++m_size;
+                    }
+                }
+            }
+            catch (...) {
+                /* Keep what we have so far. */
+                m_root = node_type::splice(lhs, run, rhs);
+                throw;
+            }
+
+            m_root = node_type::splice(lhs, run, rhs);
+        }
+    }
+
+    /* Implementation of erase_if(). Dead nodes go too, whatever pred says. */
+    template <typename Predicate>
+    size_type erase_matching (Predicate& pred) {
+        size_type erased = 0;
+        m_root = node_type::rebuild_filtered(m_root,
+                [&] (node_type* s) {
+                    return !node_type::is_dead(s)
+                            && !pred(static_cast<const value_type&>(s->value()));
+                },
+                [&] (node_type* s) {
+                    destroy(s);
+                    ++erased;
+                });
+
+        erased -= dead_nodes(access_tag());
+        m_size -= erased + dead_nodes(access_tag());
+        forget_dead(access_tag());
+        return erased;
+    }
+
+    /* Remove every dead node from the tree, rebuilding it into a balanced
+     * tree. Does nothing if there are none. */
+    void purge_dead () {
+        if (!dead_nodes(access_tag())) {
+            return;
+        }
+
+        m_root = node_type::rebuild_filtered(m_root,
+                [] (node_type* s) { return !node_type::is_dead(s); },
+                [&] (node_type* s) { destroy(s); });
+        m_size -= dead_nodes(access_tag());
+        forget_dead(access_tag());
+    }
+
+    using arena_type = detail::node_arena<node_type>;
+
+    /* If the depth guard is on, search for value, so that a long path to
+     * it is rebuilt before a search which can't rebuild it goes down it.
+     * This also splays value's neighborhood to the root, so that second
+     * search is short. */
+    template <typename Value>
+    void guard_search (const Value& value) {
+        if (m_depth_guard && m_root) {
+            int order;
+            m_root = node_type::search(m_root, value, m_comp, order, max_search_depth());
+        }
+    }
+
+    /* The deepest a search may go before set_depth_guard() steps in. */
+    size_t max_search_depth () const {
+        size_t log2 = 0;
+        for (auto n = m_size; n; n >>= 1) {
+            ++log2;
+        }
+        return static_cast<size_t>(m_depth_guard * std::max<size_t>(log2, 1));
+    }
+
+    /* Free a node which has been removed from the tree, wherever it was
+     * allocated. */
+    void destroy (node_type* s) {
+        if (m_arena && m_arena->owns(s)) {
+            m_arena->destroy(s);
+            if (!m_arena->live()) {
+                m_arena.reset();
+            }
+        }
+        else {
+            delete s;
+        }
+    }
+
+    /* Free the whole tree s. */
+    void destroy_all (node_type* s) {
+        if (!m_arena) {
+            /* Every node is individually allocated. */
+            delete s;
+            return;
+        }
+
+        std::vector<node_type*> stack;
+        if (s) {
+            stack.push_back(s);
+        }
+        while (!stack.empty()) {
+            s = stack.back();
+            stack.pop_back();
+            if (auto p = s->detach_left()) {
+                stack.push_back(p);
+            }
+            if (auto p = s->detach_right()) {
+                stack.push_back(p);
+            }
+            destroy(s);
+        }
+    }
+
+    /* Unlink s from the tree, for good, and return a node holding its
+     * value which another tree can own: s itself, unless s is in our arena,
+     * in which case its value is moved into an individually allocated node.
+     * That node is allocated before s is unlinked, so if allocating it or
+     * moving the value throws, the tree is left as it was. */
+    node_type* take (node_type* s) {
+        auto taken = s;
+        if (m_arena && m_arena->owns(s)) {
+            taken = new node_type(std::move(s->value()));
+        }
+
+        m_root = node_type::extract(s);
+        --m_size;
+        if (taken != s) {
+            destroy(s);
+        }
+        return taken;
+    }
+
+    /* Called by access_base<frequency_access_tag>::optimize(). */
+    void rebuild_by_frequency () {
+        /* Add one to every count, so that elements which were never accessed
+         * still have positive weight. */
+        double expected_depth;
+        m_root = node_type::rebuild_weighted(m_root, [] (node_type* s) {
+            std::uint64_t weight = s->m_hits + 1;
+            s->m_hits /= 2;
+            return weight;
+        }, expected_depth);
+
+        this->rebuilt(expected_depth);
+    }
+
+    /* Search for probe, and if it is not found, link in the node returned by
+     * make_node() as the new root. make_node is only called if an insertion
+     * will take place. */
+    template <typename Key, typename MakeNode>
+    std::pair<iterator, bool> find_or_insert (const Key& probe, MakeNode make_node) {
+        int order;
+        if (end() == find_value(probe, order)) {
+            return insert_found(make_node(), order);
+        }
+        return std::make_pair(iterator(m_root), false);
+    }
+
     template <typename... Args>
     std::pair<iterator, bool> emplace (typename detail::insert_unique_tag, Args&&... args) {
         /* TODO I'll have to study how other people implement emplace() for
          * their data structures--this feels flawed. */
         auto newroot = new node_type (std::forward<Args>(args)...);
-        if (end() == find_value(newroot->value())) {
-            return insert_aux(newroot);
+        int order;
+        if (end() == find_value(newroot->value(), order)) {
+            return insert_found(newroot, order);
         }
         delete newroot;
         newroot = nullptr;
@@ -1050,17 +3899,17 @@ private:
     }
 
     std::pair<iterator, bool> insert (const value_type& value, typename detail::insert_unique_tag) {
-        if (end() == find_value(value)) {
-            auto newroot = new node_type(value);
-            return insert_aux(newroot);
+        int order;
+        if (end() == find_value(value, order)) {
+            return insert_found_value(value, order);
         }
         return std::make_pair(iterator(m_root), false);
     }
 
     std::pair<iterator, bool> insert (value_type&& value, typename detail::insert_unique_tag) {
-        if (end() == find_value(value)) {
-            auto newroot = new node_type(std::forward<value_type>(value));
-            return insert_aux(newroot);
+        int order;
+        if (end() == find_value(value, order)) {
+            return insert_found_value(std::move(value), order);
         }
         return std::make_pair(iterator(m_root), false);
     }
@@ -1068,8 +3917,19 @@ private:
     value_compare m_comp;
     size_type m_size;
     node_type* m_root;
+
+    /* Where our nodes live after compact(), if it was ever called. */
+    std::unique_ptr<arena_type> m_arena;
+
+    double m_depth_guard = 0;
 };
 
+template <typename Base>
+constexpr const char splaytree<Base>::snapshot_magic[4];
+
+template <typename Base>
+constexpr std::uint32_t splaytree<Base>::snapshot_version;
+
 //////////////////////////////////////////////////////////////////////////////
 
 /* A set container that uses a splaytree implementation. */
@@ -1080,6 +3940,47 @@ using set = splaytree<detail::set_base<T, Compare, detail::insert_unique_tag>>;
 template <typename Key, typename T, typename Compare = std::less<Key>>
 using map = splaytree<detail::map_base<Key, T, Compare, detail::insert_unique_tag>>;
 
+/* Set and map containers which count accesses, and can rebuild themselves
+ * into a nearly optimal shape for them. See detail::access_base. */
+template <typename T, typename Compare = std::less<T>>
+using frequency_set = splaytree<detail::set_base<T, Compare, detail::insert_unique_tag,
+      detail::frequency_access_tag>>;
+
+template <typename Key, typename T, typename Compare = std::less<Key>>
+using frequency_map = splaytree<detail::map_base<Key, T, Compare, detail::insert_unique_tag,
+      detail::frequency_access_tag>>;
+
+/* Set and map containers whose nodes are threaded in symmetric order, for
+ * faster iteration at the cost of two more pointers per node. */
+template <typename T, typename Compare = std::less<T>>
+using threaded_set = splaytree<detail::set_base<T, Compare, detail::insert_unique_tag,
+      detail::threaded_access_tag>>;
+
+template <typename Key, typename T, typename Compare = std::less<Key>>
+using threaded_map = splaytree<detail::map_base<Key, T, Compare, detail::insert_unique_tag,
+      detail::threaded_access_tag>>;
+
+/* Set and map containers which keep a Monoid sum of every subtree, so that
+ * aggregate() can sum any range of keys quickly. See detail::monoid_aux for
+ * what a Monoid looks like. */
+template <typename T, typename Monoid, typename Compare = std::less<T>>
+using augmented_set = splaytree<detail::set_base<T, Compare, detail::insert_unique_tag,
+      detail::augmented_access_tag<Monoid>>>;
+
+template <typename Key, typename T, typename Monoid, typename Compare = std::less<Key>>
+using augmented_map = splaytree<detail::map_base<Key, T, Compare, detail::insert_unique_tag,
+      detail::augmented_access_tag<Monoid>>>;
+
+/* Set and map containers whose erase() only marks elements dead, and
+ * removes them in batches. See access_base<Derived, lazy_erase_access_tag>. */
+template <typename T, typename Compare = std::less<T>>
+using lazy_set = splaytree<detail::set_base<T, Compare, detail::insert_unique_tag,
+      detail::lazy_erase_access_tag>>;
+
+template <typename Key, typename T, typename Compare = std::less<Key>>
+using lazy_map = splaytree<detail::map_base<Key, T, Compare, detail::insert_unique_tag,
+      detail::lazy_erase_access_tag>>;
+
 } // namespace splaytree
 
 #endif
@@ -0,0 +1,109 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * spsc_ring.hpp
+ *
+ * A bounded ring buffer for handing work from exactly one producer thread to
+ * exactly one consumer thread. The slots are objects which live in the ring
+ * for its whole lifetime: the producer fills a slot in place and publishes
+ * it, and the consumer uses it in place and releases it. Slots are reused
+ * rather than reconstructed, so anything they own (a string's buffer, a
+ * vector's capacity) is allocated once and recycled from then on.
+ *
+ * Each side only ever writes its own index, so no locks are needed. A side
+ * which finds the ring full or empty spins for a while and then yields its
+ * time slice until the other side catches up.
+ */
+
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <cassert>
+#include <cstddef>
+
+#include <atomic>
+#include <thread>
+
+template <typename T, size_t N>
+class spsc_ring {
+public:
+    static_assert(N && !(N & (N - 1)), "spsc_ring's size must be a power of two");
+
+    spsc_ring () = default;
+
+    spsc_ring (const spsc_ring&) = delete;
+    spsc_ring& operator= (const spsc_ring&) = delete;
+
+    /* Producer: wait for a free slot, and return it for filling. Returns null
+     * if the ring was closed, in which case the producer should give up. */
+    T* acquire () {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        for (unsigned spins = 0; tail - m_head.load(std::memory_order_acquire) == N; ++spins) {
+            if (closed()) {
+                return nullptr;
+            }
+            backoff(spins);
+        }
+        return &m_slots[tail & (N - 1)];
+    }
+
+    /* Producer: hand the slot returned by acquire() to the consumer. */
+    void publish () {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /* Consumer: wait for a published slot, and return it. Returns null once
+     * the ring is closed and every published slot has been consumed. */
+    T* peek () {
+        auto head = m_head.load(std::memory_order_relaxed);
+        for (unsigned spins = 0; head == m_tail.load(std::memory_order_acquire); ++spins) {
+            if (closed()) {
+                /* The producer may have published just before closing. */
+                if (head != m_tail.load(std::memory_order_acquire)) {
+                    break;
+                }
+                return nullptr;
+            }
+            backoff(spins);
+        }
+        return &m_slots[head & (N - 1)];
+    }
+
+    /* Consumer: give the slot returned by peek() back to the producer. */
+    void release () {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /* Either side: no more slots will be published or consumed. Once the
+     * consumer has drained what was published, peek() returns null, and
+     * acquire() returns null as soon as the ring is full. The consumer can
+     * close the ring to stop the producer early. */
+    void close () {
+        m_closed.store(true, std::memory_order_release);
+    }
+
+    bool closed () const {
+        return m_closed.load(std::memory_order_acquire);
+    }
+
+private:
+    static void backoff (unsigned spins) {
+        if (spins >= 64) {
+            std::this_thread::yield();
+        }
+    }
+
+    /* Keep the indices on separate cache lines, so that the two threads
+     * don't fight over one line every time either of them moves. */
+    alignas(64) std::atomic<size_t> m_head { 0 };
+    alignas(64) std::atomic<size_t> m_tail { 0 };
+    alignas(64) std::atomic<bool> m_closed { false };
+
+    T m_slots[N];
+};
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * California State University East Bay
+ * CS4110 - Compiler Design
+ * Author: Harris Hancock (hhancock 'at' horizon)
+ *
+ * Symbol Table Assignment (8 October 2013)
+ *
+ * string_map.hpp
+ *
+ * A map from strings to values, implemented as a splay tree whose nodes
+ * carry their key's characters inline. In a splaytree::map<std::string, T>,
+ * every node is one allocation, and every key too long for the string's
+ * small buffer is another one somewhere else on the heap, so each comparison
+ * during a search chases one more pointer. Here, each node is allocated with
+ * exactly enough room after it for its key's characters, which are copied
+ * there once, when the element is inserted. That is one allocation per
+ * element, and the characters sit right next to the links a search has just
+ * loaded.
+ *
+ * Keys are exposed as std::string_views of those characters: an element is
+ * a std::pair<const std::string_view, T>, so iterators look just like a
+ * std::map's, and the comparison function compares string_views. A key's
+ * view stays valid for as long as its element does. Lookups take any
+ * string_view, so searching never copies a key either.
+ *
+ * Nodes are still splaytree's node class, so the tree itself behaves
+ * exactly like a splaytree::map. Since nodes differ in size, they can't be
+ * deleted with delete, and string_map takes care of allocating and
+ * destroying them itself. Only a subset of std::map's interface is
+ * provided.
+ */
+
+#ifndef STRING_MAP_HPP
+#define STRING_MAP_HPP
+
+#include "splaytree.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+#include <functional>
+#include <initializer_list>
+#include <new>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace splaytree {
+
+namespace detail {
+
+/* Compares bare keys against string_map elements, in either direction. Like
+ * map_base's value_compare, it supports three-way comparison if Compare
+ * does, which std::less<std::string_view> does. */
+template <typename T, typename Compare>
+struct inline_key_compare {
+    using value_type = std::pair<const std::string_view, T>;
+
+    bool operator() (std::string_view lhs, const value_type& rhs) const {
+        return comp(lhs, rhs.first);
+    }
+
+    bool operator() (const value_type& lhs, std::string_view rhs) const {
+        return comp(lhs.first, rhs);
+    }
+
+    template <typename C = Compare>
+    auto three_way (std::string_view lhs, const value_type& rhs) const
+            -> decltype(detail::three_way(std::declval<const C&>(), lhs, rhs.first)) {
+        return detail::three_way(comp, lhs, rhs.first);
+    }
+
+    template <typename C = Compare>
+    auto three_way (const value_type& lhs, std::string_view rhs) const
+            -> decltype(detail::three_way(std::declval<const C&>(), lhs.first, rhs)) {
+        return detail::three_way(comp, lhs.first, rhs);
+    }
+
+    Compare comp;
+};
+
+} // namespace detail
+
+//////////////////////////////////////////////////////////////////////////////
+
+template <typename T, typename Compare = std::less<std::string_view>>
+class string_map {
+public:
+    using key_type = std::string_view;
+    using mapped_type = T;
+    using value_type = std::pair<const std::string_view, T>;
+    using key_compare = Compare;
+
+    using reference = value_type&;
+    using const_reference = const value_type&;
+
+    using node_type = detail::node<value_type>;
+
+    using iterator = detail::iterator<node_type>;
+    using const_iterator = detail::const_iterator<node_type>;
+
+    using difference_type = ptrdiff_t;
+    using size_type = size_t;
+
+    explicit string_map (const key_compare& comp = key_compare())
+            : m_comp { comp } { }
+
+    string_map (const string_map& other) : string_map(other.begin(), other.end(), other.key_comp()) { }
+
+    string_map (string_map&& other) : string_map() {
+        swap(other);
+    }
+
+    template <typename Iter>
+    string_map (Iter first, Iter last, const key_compare& comp = key_compare())
+            : string_map(comp) {
+        insert(first, last);
+    }
+
+    string_map (std::initializer_list<value_type> ilist,
+                const key_compare& comp = key_compare())
+            : string_map(ilist.begin(), ilist.end(), comp) { }
+
+    ~string_map () {
+        destroy_all(m_root);
+    }
+
+    string_map& operator= (string_map other) {
+        swap(other);
+        return *this;
+    }
+
+    void swap (string_map& other) {
+        using std::swap;
+        swap(m_comp, other.m_comp);
+        swap(m_size, other.m_size);
+        swap(m_root, other.m_root);
+    }
+
+    friend void swap (string_map& lhs, string_map& rhs) {
+        lhs.swap(rhs);
+    }
+
+    iterator begin () { return iterator(node_type::minimum(m_root)); }
+    const_iterator begin () const { return const_iterator(node_type::minimum(m_root)); }
+    const_iterator cbegin () const { return begin(); }
+
+    iterator end () { return iterator(); }
+    const_iterator end () const { return const_iterator(); }
+    const_iterator cend () const { return end(); }
+
+    size_type size () const { return m_size; }
+
+    bool empty () const {
+        assert(!!m_size == !!m_root);
+        return !m_root;
+    }
+
+    key_compare key_comp () const { return m_comp.comp; }
+
+    void clear () {
+        destroy_all(m_root);
+        m_root = nullptr;
+        m_size = 0;
+    }
+
+    /* Insert an element with the given key and a mapped value constructed
+     * from args, unless the key is already present, in which case nothing
+     * is constructed. Either way, the element with that key is splayed to
+     * the root. */
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace (std::string_view key, Args&&... args) {
+        int order = 0;
+        if (m_root) {
+            m_root = node_type::search(m_root, key, m_comp, order);
+            if (!order) {
+                return std::make_pair(iterator(m_root), false);
+            }
+        }
+
+        auto s = create(key, std::forward<Args>(args)...);
+        node_type* lhs = nullptr;
+        node_type* rhs = nullptr;
+
+        if (order < 0) {
+            lhs = m_root->detach_left();
+            rhs = m_root;
+        }
+        else if (order > 0) {
+            lhs = m_root;
+            rhs = m_root->detach_right();
+        }
+
+        m_root = s;
+        m_root->attach_left(lhs);
+        m_root->attach_right(rhs);
+        ++m_size;
+
+        return std::make_pair(iterator(m_root), true);
+    }
+
+    std::pair<iterator, bool> insert (const value_type& value) {
+        return try_emplace(value.first, value.second);
+    }
+
+    template <typename Iter>
+    void insert (Iter first, Iter last) {
+        while (first != last) {
+            insert(*first++);
+        }
+    }
+
+    void insert (std::initializer_list<value_type> ilist) {
+        insert(ilist.begin(), ilist.end());
+    }
+
+    /* Get a reference to the value at the given key, inserting a default
+     * value if it does not already exist. */
+    mapped_type& operator[] (std::string_view key) {
+        return try_emplace(key).first->second;
+    }
+
+    size_type erase (std::string_view key) {
+        auto it = find(key);
+        if (end() == it) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    iterator erase (const_iterator pos) {
+        assert(pos.m_node);
+
+        auto s = pos++.m_node;
+        m_root = node_type::extract(s);
+        destroy(s);
+        --m_size;
+
+        return iterator(pos.m_node);
+    }
+
+    /* Return an iterator to the given key, or end() if it is not found. */
+    iterator find (std::string_view key) {
+        if (!m_root) {
+            return end();
+        }
+
+        int order;
+        m_root = node_type::search(m_root, key, m_comp, order);
+        return order ? end() : iterator(m_root);
+    }
+
+    size_type count (std::string_view key) {
+        return end() != find(key);
+    }
+
+    /* Return an iterator to the first element whose key is not less than the
+     * given key, or end() if there is none. */
+    iterator lower_bound (std::string_view key) {
+        auto bound = node_type::lower_bound(m_root, key, m_comp);
+        if (bound) {
+            m_root = bound;
+        }
+        return iterator(bound);
+    }
+
+    /* The number of bytes each element takes up on the heap, besides
+     * whatever its mapped value allocates itself. */
+    static size_type element_size (std::string_view key) {
+        return sizeof(node_type) + key.size();
+    }
+
+private:
+    /* Allocate a node with room for key's characters after it, copy them
+     * there, and construct the node's element around a view of them. */
+    template <typename... Args>
+    static node_type* create (std::string_view key, Args&&... args) {
+        auto memory = ::operator new(element_size(key));
+        auto chars = static_cast<char*>(memory) + sizeof(node_type);
+        if (!key.empty()) {
+            std::memcpy(chars, key.data(), key.size());
+        }
+
+        try {
+            return new (memory) node_type(std::piecewise_construct,
+                    std::forward_as_tuple(chars, key.size()),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+        }
+        catch (...) {
+            ::operator delete(memory);
+            throw;
+        }
+    }
+
+    /* Destroy and free a single node, which must have no children left:
+     * node's destructor would delete them with plain delete. */
+    static void destroy (node_type* s) {
+        s->~node_type();
+        ::operator delete(s);
+    }
+
+    static void destroy_all (node_type* s) {
+        std::vector<node_type*> stack;
+        if (s) {
+            stack.push_back(s);
+        }
+
+        while (!stack.empty()) {
+            s = stack.back();
+            stack.pop_back();
+            if (auto lhs = s->detach_left()) {
+                stack.push_back(lhs);
+            }
+            if (auto rhs = s->detach_right()) {
+                stack.push_back(rhs);
+            }
+            destroy(s);
+        }
+    }
+
+    detail::inline_key_compare<T, Compare> m_comp;
+    size_type m_size = 0;
+    node_type* m_root = nullptr;
+};
+
+} // namespace splaytree
+
+#endif
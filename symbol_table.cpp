@@ -0,0 +1,297 @@
+#include "symbol_table.hpp"
+
+#include <cassert>
+#include <cstdio>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/* The text dump of a symbol table, minus its title line. */
+std::string dump (const symbol_table_scope_manager& symtab) {
+    std::ostringstream output;
+    symtab.display(output);
+    auto text = output.str();
+    return text.substr(text.find('\n') + 1);
+}
+
+int main () {
+    {
+        /* Freeze the global scope and a nested one, then carry on. */
+        symbol_table_scope_manager symtab;
+        symtab.open_scope();
+        symtab.insert("x");
+        symtab.insert("y");
+        symtab.open_scope();
+        symtab.insert("x");
+
+        auto frozen = symtab.freeze();
+        assert(3 == frozen->size() && 2 == frozen->scope_count());
+        assert(3 == symtab.size() && symtab.begin() == symtab.end());
+        assert(frozen->end() != frozen->find(0, "y") && frozen->end() == frozen->find(1, "y"));
+        assert(2 == std::distance(frozen->begin(0), frozen->end(0)));
+
+        /* The active scopes are frozen now. */
+        try {
+            symtab.insert("z");
+            assert(false);
+        }
+        catch (std::logic_error&) { }
+
+        /* find() stops at the first frozen scope, and resolve() goes on to
+         * search them, innermost first. */
+        symtab.open_scope();
+        symtab.insert("y");
+        assert(symtab.end() != symtab.find("y") && symtab.end() == symtab.find("x"));
+        assert(2 == symtab.resolve("y")->first.first);
+        assert(1 == symtab.resolve("x")->first.first);
+        symtab.close_scope();
+        assert(symtab.end() == symtab.find("y"));
+        assert(0 == symtab.resolve("y")->first.first);
+        assert(!symtab.resolve("z"));
+        symtab.close_scope();
+        assert(0 == symtab.resolve("x")->first.first);
+        assert(4 == symtab.size() && 3 == symtab.scope_count());
+
+        /* Another manager on top of the same frozen scopes starts with the
+         * same active scopes, and its own symbols. */
+        symbol_table_scope_manager other { frozen };
+        assert(1 == other.resolve("x")->first.first);
+        other.open_scope();
+        assert(2 == other.insert("x").first->first.first);
+        assert(2 == other.resolve("x")->first.first);
+        assert(4 == other.size() && 4 == symtab.size());
+
+        /* Both frozen and live symbols are dumped, in order. */
+        assert("Scope 0:\n"
+               "\tx : reference_count<0>\n"
+               "\ty : reference_count<0>\n"
+               "Scope 1:\n"
+               "\tx : reference_count<0>\n"
+               "Scope 2:\n"
+               "\tx : reference_count<0>\n" == dump(other));
+
+        /* Freezing again keeps the earlier frozen scopes. */
+        auto refrozen = other.freeze();
+        assert(4 == refrozen->size() && 3 == refrozen->scope_count());
+        printf("freeze: %zu frozen symbols\n", refrozen->size());
+    }
+
+    {
+        /* Nested checkpoints: committing the inner one hands its changes to
+         * the outer one, and rolling back the inner one keeps the outer
+         * one's. */
+        symbol_table_scope_manager symtab;
+        symtab.open_scope();
+        symtab.insert("a");
+
+        auto outer = symtab.checkpoint();
+        symtab.insert("b");
+        auto inner = symtab.checkpoint();
+        symtab.insert("c");
+        symtab.commit(inner);
+        assert(3 == symtab.size());
+        symtab.rollback(outer);
+        assert(1 == symtab.size() && symtab.end() == symtab.find("b"));
+        assert(symtab.end() == symtab.find("c") && symtab.end() != symtab.find("a"));
+
+        outer = symtab.checkpoint();
+        symtab.insert("b");
+        inner = symtab.checkpoint();
+        symtab.insert("c");
+        symtab.rollback(inner);
+        assert(2 == symtab.size() && symtab.end() == symtab.find("c"));
+        symtab.commit(outer);
+        assert(2 == symtab.size() && symtab.end() != symtab.find("b"));
+
+        /* Scopes opened and closed since a checkpoint, and references
+         * added, are rolled back too. */
+        auto before = dump(symtab);
+        auto checkpoint = symtab.checkpoint();
+        symtab.add_reference(symtab.find("a"));
+        symtab.open_scope();
+        symtab.insert("d");
+        symtab.add_reference(symtab.find("d"));
+        symtab.close_scope();
+        symtab.close_scope();
+        symtab.open_scope();
+        symtab.insert("e");
+        assert(3 == symtab.scope_count());
+        assert("Scope 0:\n"
+               "\ta : reference_count<1>\n"
+               "\tb : reference_count<0>\n"
+               "Scope 1:\n"
+               "\td : reference_count<1>\n"
+               "Scope 2:\n"
+               "\te : reference_count<0>\n" == dump(symtab));
+        symtab.rollback(checkpoint);
+        assert(1 == symtab.scope_count() && before == dump(symtab));
+        assert(0 == symtab.find("a")->second.reference_count);
+
+        /* After the rollback, scope 0 is active again, and scope 1 is the
+         * next one opened. */
+        symtab.insert("f");
+        symtab.open_scope();
+        assert(1 == symtab.insert("g").first->first.first);
+
+        /* A token which is no longer open can't be used, even if a new
+         * checkpoint has since been taken at the same depth and with the
+         * same log length. */
+        auto stale = symtab.checkpoint();
+        symtab.commit(stale);
+        auto fresh = symtab.checkpoint();
+        symtab.insert("h");
+        try {
+            symtab.rollback(stale);
+            assert(false);
+        }
+        catch (std::logic_error&) { }
+        try {
+            symtab.commit(stale);
+            assert(false);
+        }
+        catch (std::logic_error&) { }
+        assert(symtab.end() != symtab.find("h"));
+
+        /* Closing an outer checkpoint closes the inner ones with it. */
+        auto nested = symtab.checkpoint();
+        symtab.rollback(fresh);
+        assert(symtab.end() == symtab.find("h"));
+        try {
+            symtab.rollback(nested);
+            assert(false);
+        }
+        catch (std::logic_error&) { }
+
+        /* Frozen scopes can't be rolled back, so freezing waits until no
+         * checkpoint is open. */
+        checkpoint = symtab.checkpoint();
+        try {
+            symtab.freeze();
+            assert(false);
+        }
+        catch (std::logic_error&) { }
+        symtab.commit(checkpoint);
+        assert(4 == symtab.freeze()->size());
+        printf("checkpoints: %zu symbols\n", symtab.size());
+    }
+
+    {
+        /* A counter which overflows must stick, rather than wrap around to
+         * zero and deny a string that is there. */
+        counting_bloom_filter filter;
+        for (int i = 0; i < 256; ++i) {
+            filter.insert("x");
+        }
+        assert(filter.may_contain("x") && 256 == filter.size());
+        for (int i = 0; i < 255; ++i) {
+            filter.erase("x");
+        }
+        assert(filter.may_contain("x") && 1 == filter.size());
+        filter.insert("y");
+        filter.erase("y");
+        assert(filter.may_contain("x"));
+
+        filter.reset(1000);
+        assert(!filter.may_contain("x") && filter.capacity() >= 1000);
+    }
+
+    {
+        /* With the lookup filter on, find() must agree with a symbol table
+         * without one, whatever happened to the filter along the way. */
+        symbol_table_scope_manager plain;
+        symbol_table_scope_manager filtered;
+        filtered.set_lookup_filter(true);
+        assert(filtered.lookup_filter() && !plain.lookup_filter());
+
+        auto both = [&] (void (symbol_table_scope_manager::*f) ()) {
+            (plain.*f)();
+            (filtered.*f)();
+        };
+        auto insert = [&] (const std::string& id) {
+            plain.insert(id);
+            filtered.insert(id);
+        };
+        auto agree = [&] (const std::string& id) {
+            auto lhs = plain.find(id);
+            auto rhs = filtered.find(id);
+            assert((plain.end() == lhs) == (filtered.end() == rhs));
+            assert(plain.end() == lhs || lhs->first == rhs->first);
+        };
+        auto agree_on_all = [&] {
+            for (int i = 0; i < 1200; ++i) {
+                agree("v" + std::to_string(i));
+            }
+        };
+
+        /* Enough symbols to outgrow the filter several times over. */
+        both(&symbol_table_scope_manager::open_scope);
+        for (int i = 0; i < 1000; ++i) {
+            insert("v" + std::to_string(i));
+        }
+        agree_on_all();
+
+        both(&symbol_table_scope_manager::open_scope);
+        for (int i = 0; i < 1000; i += 3) {
+            insert("v" + std::to_string(i));
+        }
+        agree_on_all();
+        both(&symbol_table_scope_manager::close_scope);
+        agree_on_all();
+
+        /* Roll back across a closed scope, which puts its symbols back in
+         * the filter. */
+        auto a = plain.checkpoint();
+        auto b = filtered.checkpoint();
+        both(&symbol_table_scope_manager::open_scope);
+        for (int i = 1000; i < 1100; ++i) {
+            insert("v" + std::to_string(i));
+        }
+        both(&symbol_table_scope_manager::close_scope);
+        both(&symbol_table_scope_manager::close_scope);
+        agree_on_all();
+        plain.rollback(a);
+        filtered.rollback(b);
+        agree_on_all();
+
+        /* Roll back an insertion, which takes it back out. */
+        a = plain.checkpoint();
+        b = filtered.checkpoint();
+        insert("v1150");
+        agree("v1150");
+        plain.rollback(a);
+        filtered.rollback(b);
+        agree("v1150");
+
+        /* Frozen scopes are never in the filter, and find() never gets to
+         * them anyway. */
+        plain.freeze();
+        filtered.freeze();
+        both(&symbol_table_scope_manager::open_scope);
+        insert("v5");
+        insert("v1199");
+        agree_on_all();
+
+        /* More than 255 copies of one identifier, in as many nested
+         * scopes, all land on the same counters. Closing all but one of
+         * those scopes must not lose the last copy. */
+        for (int i = 0; i < 300; ++i) {
+            both(&symbol_table_scope_manager::open_scope);
+            insert("deep");
+        }
+        for (int i = 0; i < 299; ++i) {
+            both(&symbol_table_scope_manager::close_scope);
+            agree("deep");
+        }
+        assert(filtered.end() != filtered.find("deep"));
+        both(&symbol_table_scope_manager::close_scope);
+        agree("deep");
+
+        /* Turning the filter off and on again rebuilds it from scratch. */
+        filtered.set_lookup_filter(false);
+        agree_on_all();
+        filtered.set_lookup_filter(true);
+        agree_on_all();
+        printf("lookup filter: %zu symbols\n", filtered.size());
+    }
+}
@@ -13,19 +13,52 @@
  * use the non-const version for this assignment. Similarly, I only have a
  * const version of symbol_table_scope_manager::begin(scope_id), because I
  * only use the const version for this assignment.
+ *
+ * For resolving symbols on several threads at once, the outer scopes of a
+ * symbol table (typically the huge global scope) can be frozen. A frozen
+ * scope is copied into a sorted array, which never changes again, so any
+ * number of threads can search it without locking, where searching the
+ * splaytree would splay it. Each thread then gets its own
+ * symbol_table_scope_manager on top of the frozen scopes, with a private
+ * splaytree for the scopes it opens itself.
+ *
+ * For speculative parsing and error recovery, the scope manager can also
+ * take checkpoints, and later roll back to one or commit it. Rather than
+ * copying the symbol table, it keeps an undo log of every change made while
+ * a checkpoint is open, so taking a checkpoint is O(1), and rolling back
+ * takes time proportional to the number of changes since.
+ *
+ * Most lookups which miss are for identifiers that no active scope has at
+ * all, and each one costs a full search, and a splay, per active scope. With
+ * set_lookup_filter(true), the scope manager keeps a counting Bloom filter
+ * of the identifiers in its active scopes, and find() gives up on those
+ * right away, without touching the tree.
  */
 
 #ifndef SYMBOL_TABLE_HPP
 #define SYMBOL_TABLE_HPP
 
+#include "bloom_filter.hpp"
+#include "output_buffer.hpp"
 #include "splaytree.hpp"
 
+#include <algorithm>
 #include <deque>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
 
 /* A scope_id is a numeric value which uniquely identifies a lexical scope. */
 using scope_id = unsigned;
 using identifier = std::string;
 
+/* A non-owning reference to an identifier, such as a lexeme still sitting in
+ * the input buffer. Lookups use these so that we only copy an identifier's
+ * characters when it is actually inserted. */
+using identifier_view = std::string_view;
+
 /* We'll be using the one-giant-symbol-table strategy for scope management,
  * with an underlying data structure which supports a std::map-like interface.
  * For this associative container, we can use a 2-tuple of a scope_id and the
@@ -38,6 +71,29 @@ using identifier = std::string;
  * have the increment of the scope_id in question, and return an end iterator.
  */
 using id_key = std::pair<scope_id, identifier>;
+using id_key_view = std::pair<scope_id, identifier_view>;
+
+/* Orders id_keys and id_key_views exactly like std::pair's operator< orders
+ * id_keys. It is transparent, so the symbol table can be searched with an
+ * id_key_view without building an id_key first. It also provides a three-way
+ * comparison, so the splaytree only needs to compare identifiers once at each
+ * level of a search. */
+struct id_key_less {
+    using is_transparent = void;
+
+    template <typename Lhs, typename Rhs>
+    bool operator() (const Lhs& lhs, const Rhs& rhs) const {
+        return three_way(lhs, rhs) < 0;
+    }
+
+    template <typename Lhs, typename Rhs>
+    int three_way (const Lhs& lhs, const Rhs& rhs) const {
+        if (lhs.first != rhs.first) {
+            return lhs.first < rhs.first ? -1 : 1;
+        }
+        return identifier_view(lhs.second).compare(identifier_view(rhs.second));
+    }
+};
 
 struct id_record {
     /* placeholder until we have stuff to put here */
@@ -48,7 +104,69 @@ struct id_record {
  * container which provides a std::map-like interface will do. Note that if we
  * used a hash table (such as std::unordered_map), we would need to write a
  * hash routine as well. */
-using symbol_table = splaytree::map<id_key, id_record>;
+using symbol_table = splaytree::map<id_key, id_record, id_key_less>;
+
+/* Scopes sealed by symbol_table_scope_manager::freeze(). The symbols are kept
+ * in one sorted array and searched by bisection. Nothing in a frozen_scopes
+ * changes after it is built, so it is safe to share between threads. */
+class frozen_scopes {
+public:
+    using value_type = symbol_table::value_type;
+    using const_iterator = std::vector<value_type>::const_iterator;
+
+    const_iterator begin () const { return m_symbols.begin(); }
+    const_iterator end () const { return m_symbols.end(); }
+
+    /* Get an iterator to the first symbol in scope sid. */
+    const_iterator begin (scope_id scope) const {
+        return lower_bound(id_key_view(scope, identifier_view()));
+    }
+
+    /* Get an iterator to one past the last symbol in scope sid. */
+    const_iterator end (scope_id scope) const {
+        return lower_bound(id_key_view(scope + 1, identifier_view()));
+    }
+
+    /* Search for an identifier in a specific scope. */
+    const_iterator find (scope_id scope, identifier_view id) const {
+        auto key = id_key_view(scope, id);
+        auto it = lower_bound(key);
+        if (end() != it && !id_key_less()(key, it->first)) {
+            return it;
+        }
+        return end();
+    }
+
+    /* Get the number of symbols in all frozen scopes. */
+    size_t size () const {
+        return m_symbols.size();
+    }
+
+    /* Every scope_id less than this one is frozen. */
+    scope_id scope_count () const {
+        return m_scope_count;
+    }
+
+    /* The scopes which were active when these were frozen, innermost
+     * first. */
+    const std::deque<scope_id>& active_scopes () const {
+        return m_active_scopes;
+    }
+
+private:
+    friend class symbol_table_scope_manager;
+
+    const_iterator lower_bound (const id_key_view& key) const {
+        return std::lower_bound(begin(), end(), key,
+                [] (const value_type& symbol, const id_key_view& key) {
+                    return id_key_less()(symbol.first, key);
+                });
+    }
+
+    std::vector<value_type> m_symbols;
+    std::deque<scope_id> m_active_scopes;
+    scope_id m_scope_count = 0;
+};
 
 /* Unified class that handles symbol table and scope management. */
 class symbol_table_scope_manager {
@@ -60,10 +178,42 @@ public:
      * this class in the future to be more defensive. */
     using iterator = symbol_table::iterator;
     using const_iterator = symbol_table::const_iterator;
+    using value_type = symbol_table::value_type;
+
+    /* Returned by checkpoint(), to be passed to exactly one of rollback()
+     * or commit(). */
+    class checkpoint_token {
+        friend class symbol_table_scope_manager;
+
+        checkpoint_token (size_t depth, unsigned long long serial, size_t position)
+                : m_depth(depth), m_serial(serial), m_position(position) { }
+
+        /* How many checkpoints were already open when this one was taken,
+         * which checkpoint this is, counting from the first one this object
+         * ever took, and how long the undo log was. The serial is what
+         * tells this checkpoint apart from a later one taken at the same
+         * depth and log length, once this one is closed. */
+        size_t m_depth;
+        unsigned long long m_serial;
+        size_t m_position;
+    };
+
+    symbol_table_scope_manager () = default;
+
+    /* Start on top of some frozen scopes, with the same scopes active as
+     * when they were frozen. Scopes opened from here on get ids past the
+     * frozen ones, and their symbols live in this object alone. Each thread
+     * that wants to resolve symbols against the frozen scopes should have its
+     * own symbol_table_scope_manager built this way. */
+    explicit symbol_table_scope_manager (std::shared_ptr<const frozen_scopes> frozen)
+            : m_next_scope_id(frozen->scope_count())
+            , m_active_scopes(frozen->active_scopes())
+            , m_frozen(std::move(frozen)) { }
 
     /* Open a new scope and push it onto the active scope stack. All future
      * insertions will use this new scope, until close_scope() is called. */
     void open_scope () {
+        log(undo_entry { undo_entry::open_scope });
         m_active_scopes.push_front(m_next_scope_id++);
 
         /* If we wrap around, something probably went wrong. */
@@ -76,7 +226,48 @@ public:
     void close_scope () {
         assert(!m_active_scopes.empty());
 
+        auto scope = m_active_scopes.front();
+        log(undo_entry { undo_entry::close_scope, iterator(), id_record(), scope });
         m_active_scopes.pop_front();
+        unfilter_scope(scope);
+    }
+
+    /* Seal every scope opened so far, including any which were already
+     * frozen, and return them. This object carries on with the same active
+     * scopes, but insertions into them will throw std::logic_error. Only
+     * scopes opened after this call may have symbols added. Iterators into
+     * this object are invalidated. Throws std::logic_error if a checkpoint
+     * is open, since frozen scopes can't be rolled back. */
+    std::shared_ptr<const frozen_scopes> freeze () {
+        if (!m_checkpoints.empty()) {
+            throw std::logic_error("cannot freeze scopes with a checkpoint open");
+        }
+
+        auto frozen = std::make_shared<frozen_scopes>();
+
+        /* Frozen scope_ids are all less than our own, so the old frozen
+         * symbols followed by ours are still in order. */
+        auto& symbols = frozen->m_symbols;
+        symbols.reserve(size());
+        if (m_frozen) {
+            std::copy(m_frozen->begin(), m_frozen->end(), std::back_inserter(symbols));
+        }
+        std::copy(m_symbol_table.begin(), m_symbol_table.end(), std::back_inserter(symbols));
+        frozen->m_active_scopes = m_active_scopes;
+        frozen->m_scope_count = m_next_scope_id;
+
+        m_symbol_table.clear();
+        m_frozen = frozen;
+        if (m_filtering) {
+            m_filter.reset(0);
+        }
+        return frozen;
+    }
+
+    /* Get the frozen scopes underneath this object, or null if there are
+     * none. */
+    const std::shared_ptr<const frozen_scopes>& frozen () const {
+        return m_frozen;
     }
 
     /* Get an iterator to the first symbol in the first scope. */
@@ -84,7 +275,8 @@ public:
         return m_symbol_table.begin();
     }
 
-    /* Get an iterator to the first symbol in scope sid. */
+    /* Get an iterator to the first symbol in scope sid. Frozen scopes look
+     * empty here; search frozen() for their symbols. */
     const_iterator begin (scope_id scope) const {
         auto key = std::make_pair(scope, identifier());
         return m_symbol_table.lower_bound(key);
@@ -104,13 +296,92 @@ public:
     /* Insert identifier id into the symbol table in the currently active
      * scope. Returns an iterator to the newly-created element, or the
      * previously existing element, and a boolean signifying whether or not
-     * an insertion actually took place (true == insertion succeeded). */
-    std::pair<iterator, bool> insert (const identifier& id) {
+     * an insertion actually took place (true == insertion succeeded). The
+     * identifier is only copied if it is inserted. Throws std::logic_error
+     * if the currently active scope is frozen. */
+    std::pair<iterator, bool> insert (identifier_view id) {
         assert(!m_active_scopes.empty());
 
-        auto key = std::make_pair(m_active_scopes.front(), id);
-        auto value = std::make_pair(key, id_record());
-        return m_symbol_table.insert(value);
+        if (is_frozen(m_active_scopes.front())) {
+            throw std::logic_error("cannot insert into a frozen scope");
+        }
+
+        auto key = id_key_view(m_active_scopes.front(), id);
+        auto result = m_symbol_table.try_emplace(key);
+        if (result.second) {
+            log(undo_entry { undo_entry::insert, result.first });
+            if (m_filtering) {
+                m_filter.insert(id);
+                if (m_filter.size() > m_filter.capacity()) {
+                    rebuild_filter(2 * m_filter.size());
+                }
+            }
+        }
+        return result;
+    }
+
+    /* Record a reference to the symbol at it. Changing its record directly
+     * works too, but can't be rolled back. */
+    void add_reference (iterator it) {
+        log(undo_entry { undo_entry::update, it, it->second });
+        ++it->second.reference_count;
+    }
+
+    /* Take a checkpoint of the symbol table and the scope stack. Checkpoints
+     * nest: each must be rolled back or committed before the one taken
+     * before it, or along with it. Changes are only logged while a
+     * checkpoint is open.
+     *
+     * The undo log refers to symbols by iterator, so a copy of this object
+     * must not be rolled back to a checkpoint taken before it was made. */
+    checkpoint_token checkpoint () {
+        auto serial = m_next_checkpoint++;
+        m_checkpoints.push_back(serial);
+        return checkpoint_token(m_checkpoints.size() - 1, serial, m_undo_log.size());
+    }
+
+    /* Undo every change since the checkpoint was taken, newest first, and
+     * close it, along with any checkpoints taken after it. Iterators to
+     * symbols inserted since then are invalidated. */
+    void rollback (const checkpoint_token& token) {
+        close_checkpoint(token);
+
+        while (m_undo_log.size() > token.m_position) {
+            auto& entry = m_undo_log.back();
+            switch (entry.action) {
+                case undo_entry::insert:
+                    /* Inserts are undone in the same state they were made
+                     * in, so the symbol's scope is active. */
+                    if (m_filtering) {
+                        m_filter.erase(entry.symbol->first.second);
+                    }
+                    m_symbol_table.erase(entry.symbol);
+                    break;
+                case undo_entry::update:
+                    entry.symbol->second = entry.record;
+                    break;
+                case undo_entry::open_scope:
+                    m_active_scopes.pop_front();
+                    --m_next_scope_id;
+                    break;
+                case undo_entry::close_scope:
+                    m_active_scopes.push_front(entry.scope);
+                    filter_scope(entry.scope);
+                    break;
+            }
+            m_undo_log.pop_back();
+        }
+    }
+
+    /* Keep every change since the checkpoint was taken, and close it, along
+     * with any checkpoints taken after it. If an older checkpoint is still
+     * open, rolling it back will undo these changes as well. */
+    void commit (const checkpoint_token& token) {
+        close_checkpoint(token);
+
+        if (m_checkpoints.empty()) {
+            m_undo_log.clear();
+        }
     }
 
     /* Search through each active scope until we find a match for this
@@ -119,9 +390,21 @@ public:
      * Note that since this uses only the active scopes, it may differ from
      * the intended meaning of the FIND routine in the assignment. If FIND is
      * meant to find an identifier in a specific scope, see the two-parameter
-     * overload of find(). */
-    iterator find (const identifier& id) {
+     * overload of find().
+     *
+     * Frozen scopes are skipped, since their symbols aren't in our splaytree.
+     * Use resolve() to search those as well. With the lookup filter on, an
+     * identifier which no active scope has is usually turned away before
+     * any scope is searched. */
+    iterator find (identifier_view id) {
+        if (m_filtering && !m_filter.may_contain(id)) {
+            return end();
+        }
+
         for (auto scope : m_active_scopes) {
+            if (is_frozen(scope)) {
+                break;
+            }
             auto it = find(scope, id);
             if (m_symbol_table.end() != it) {
                 return it;
@@ -133,45 +416,254 @@ public:
     }
 
     /* Search for an identifier in a specific scope. */
-    iterator find (const scope_id scope, const identifier& id) {
-        auto key = std::make_pair(scope, id);
+    iterator find (const scope_id scope, identifier_view id) {
+        auto key = id_key_view(scope, id);
         return m_symbol_table.find(key);
     }
 
-    /* Dump the entire symbol table (all scopes) to a given output stream. */
-    void display (std::ostream& output = std::cout) const {
+    /* Like find(), but search the frozen scopes too, once our own active
+     * scopes are exhausted. Returns a pointer to the symbol, or null if no
+     * active scope has it. Symbols in frozen scopes are shared with other
+     * threads, so they are returned const. */
+    const value_type* resolve (identifier_view id) {
+        auto it = find(id);
+        if (end() != it) {
+            return &*it;
+        }
+
+        for (auto scope : m_active_scopes) {
+            if (is_frozen(scope)) {
+                auto frozen = m_frozen->find(scope, id);
+                if (m_frozen->end() != frozen) {
+                    return &*frozen;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    /* Turn the lookup filter used by find() on or off. Turning it on builds
+     * it from every symbol in the active scopes. From then on, insert(),
+     * close_scope(), and rollback() keep it up to date, which costs a few
+     * hashes per symbol, plus a walk over a scope's symbols whenever it is
+     * closed. Frozen scopes are never in the filter, since find() never
+     * searches them. */
+    void set_lookup_filter (bool enabled) {
+        m_filtering = enabled;
+        if (enabled) {
+            size_t count = 0;
+            for_each_active_symbol([&] (const value_type&) { ++count; });
+            rebuild_filter(count);
+        }
+        else {
+            m_filter = counting_bloom_filter();
+        }
+    }
+
+    bool lookup_filter () const {
+        return m_filtering;
+    }
+
+    /* Get the number of symbols in all scopes, frozen or not. */
+    size_t size () const {
+        return m_symbol_table.size() + (m_frozen ? m_frozen->size() : 0);
+    }
+
+    /* Get the number of scopes ever opened. */
+    scope_id scope_count () const {
+        return m_next_scope_id;
+    }
+
+    /* Output formats understood by display(). text is the human-readable
+     * listing. ndjson writes one JSON object per symbol per line. binary is
+     * a compact encoding made of LEB128 varints (see display_binary()). */
+    enum class format { text, ndjson, binary };
+
+    /* Dump the entire symbol table (all scopes) to a given output stream.
+     *
+     * Since the symbol table is ordered by scope first, a single in-order
+     * pass visits the scopes in order, too. All output goes through one
+     * large buffer. */
+    void display (std::ostream& output = std::cout, format fmt = format::text) const {
+        output_buffer buffer { output };
+
+        switch (fmt) {
+            case format::text: display_text(buffer); break;
+            case format::ndjson: display_ndjson(buffer); break;
+            case format::binary: display_binary(buffer); break;
+        }
+    }
+
+private:
+    /* One change to undo. symbol is used by insert and update, record by
+     * update, which keeps the symbol's previous record, and scope by
+     * close_scope. */
+    struct undo_entry {
+        enum kind { insert, update, open_scope, close_scope };
+
+        kind action;
+        iterator symbol = iterator();
+        id_record record = id_record();
+        scope_id scope = 0;
+    };
+
+    void log (const undo_entry& entry) {
+        if (!m_checkpoints.empty()) {
+            m_undo_log.push_back(entry);
+        }
+    }
+
+    /* Close the checkpoint token refers to, and every later one. Throws
+     * std::logic_error if it isn't open. */
+    void close_checkpoint (const checkpoint_token& token) {
+        if (token.m_depth >= m_checkpoints.size()
+                || m_checkpoints[token.m_depth] != token.m_serial) {
+            throw std::logic_error("checkpoint is not open");
+        }
+        m_checkpoints.resize(token.m_depth);
+    }
+
+    bool is_frozen (scope_id scope) const {
+        return m_frozen && scope < m_frozen->scope_count();
+    }
+
+    /* Call f with every symbol in our own active scopes. */
+    template <typename F>
+    void for_each_active_symbol (F f) const {
+        for (auto scope : m_active_scopes) {
+            if (is_frozen(scope)) {
+                break;
+            }
+            std::for_each(begin(scope), end(scope), f);
+        }
+    }
+
+    /* Empty the lookup filter, sized for at least expected_symbols, and
+     * refill it. */
+    void rebuild_filter (size_t expected_symbols) {
+        m_filter.reset(expected_symbols);
+        for_each_active_symbol([this] (const value_type& symbol) {
+            m_filter.insert(symbol.first.second);
+        });
+    }
+
+    /* Add or remove a scope's symbols to or from the lookup filter, as it
+     * becomes active or inactive. */
+    void filter_scope (scope_id scope) {
+        if (m_filtering && !is_frozen(scope)) {
+            std::for_each(begin(scope), end(scope), [this] (const value_type& symbol) {
+                m_filter.insert(symbol.first.second);
+            });
+        }
+    }
+
+    void unfilter_scope (scope_id scope) {
+        if (m_filtering && !is_frozen(scope)) {
+            std::for_each(begin(scope), end(scope), [this] (const value_type& symbol) {
+                m_filter.erase(symbol.first.second);
+            });
+        }
+    }
+
+    /* Call f with every symbol, frozen or not, in order. */
+    template <typename F>
+    void for_each_symbol (F f) const {
+        if (m_frozen) {
+            for (auto& symbol : *m_frozen) {
+                f(symbol);
+            }
+        }
+        for (auto& symbol : m_symbol_table) {
+            f(symbol);
+        }
+    }
+
+    void display_text (output_buffer& output) const {
         static const size_t cols = 78;
         static const std::string title { "SYMBOL TABLE" };
 
         /* Print the title, surrounded by equals signs. */
         const auto num_equals = cols - title.length() - 2;
-        for (size_t i = 0; i < num_equals / 2; ++i) {
-            output << '=';
-        }
-        output << ' ' << title << ' ';
-        for (size_t i = 0; i < num_equals / 2; ++i) {
-            output << '=';
-        }
-        /* The two for loops above use integer division, which introduces a
+        output.fill(num_equals / 2, '=');
+        output.put(' ');
+        output.write(title);
+        output.put(' ');
+        output.fill(num_equals / 2, '=');
+        /* The two fill() calls above use integer division, which introduces a
          * parity issue if the number of equals signs we wanted to print was
          * odd. Account for this. */
         if (1 & num_equals) {
-            output << '=';
+            output.put('=');
         }
-        output << '\n';
+        output.put('\n');
 
-        /* And finally print the scopes, in order. */
-        for (scope_id scope = 0; scope < m_next_scope_id; ++scope) {
-            output << "Scope " << scope << ":\n";
-            for (auto it = begin(scope); end(scope) != it; ++it) {
-                auto& lexeme = it->first.second;
-                auto& reference_count = it->second.reference_count;
-                output << "\t" << lexeme << " : reference_count<" << reference_count << ">\n";
+        /* And finally print the scopes, in order. Scopes with no symbols
+         * still get a header, so print those as we skip over them. */
+        scope_id next_header = 0;
+        auto print_headers_through = [&] (scope_id last) {
+            for (; next_header <= last; ++next_header) {
+                output.write("Scope ");
+                output.write_decimal(next_header);
+                output.write(":\n");
             }
+        };
+
+        for_each_symbol([&] (const value_type& symbol) {
+            print_headers_through(symbol.first.first);
+
+            output.put('\t');
+            output.write(symbol.first.second);
+            output.write(" : reference_count<");
+            output.write_decimal(symbol.second.reference_count);
+            output.write(">\n");
+        });
+
+        if (m_next_scope_id) {
+            print_headers_through(m_next_scope_id - 1);
         }
     }
 
-private:
+    /* Each line looks like:
+     * {"scope":1,"id":"abc","reference_count":2} */
+    void display_ndjson (output_buffer& output) const {
+        for_each_symbol([&] (const value_type& symbol) {
+            output.write("{\"scope\":");
+            output.write_decimal(symbol.first.first);
+            output.write(",\"id\":\"");
+            output.write_json_string(symbol.first.second);
+            output.write("\",\"reference_count\":");
+            output.write_decimal(symbol.second.reference_count);
+            output.write("}\n");
+        });
+    }
+
+    /* The binary format is the magic bytes "SYMT", followed by varints for
+     * the format version (currently 1), the number of scopes, and the number
+     * of symbols. Then, for every symbol in order: the difference between
+     * its scope_id and the previous symbol's (the first symbol's is relative
+     * to zero), the identifier's length, the identifier's bytes, and its
+     * reference count, zigzag-encoded. */
+    void display_binary (output_buffer& output) const {
+        output.write("SYMT");
+        output.write_varint(1);
+        output.write_varint(m_next_scope_id);
+        output.write_varint(size());
+
+        scope_id previous = 0;
+        for_each_symbol([&] (const value_type& symbol) {
+            auto& lexeme = symbol.first.second;
+            long long reference_count = symbol.second.reference_count;
+
+            output.write_varint(symbol.first.first - previous);
+            output.write_varint(lexeme.size());
+            output.write(lexeme);
+            output.write_varint(reference_count < 0
+                    ? ~(static_cast<unsigned long long>(reference_count) << 1)
+                    : static_cast<unsigned long long>(reference_count) << 1);
+            previous = symbol.first.first;
+        });
+    }
+
     scope_id m_next_scope_id = 0;
 
     /* std::stack would be a more logical choice for the active scope stack,
@@ -181,6 +673,19 @@ private:
      * linked list is overkill. */
     std::deque<scope_id> m_active_scopes;
     symbol_table m_symbol_table;
+
+    /* The scopes below ours, shared with other threads. May be null. */
+    std::shared_ptr<const frozen_scopes> m_frozen;
+
+    /* Every change since the oldest open checkpoint, oldest first, and the
+     * serial of each open checkpoint, oldest first. */
+    std::vector<undo_entry> m_undo_log;
+    std::vector<unsigned long long> m_checkpoints;
+    unsigned long long m_next_checkpoint = 0;
+
+    /* The identifiers in our active scopes, if m_filtering is on. */
+    counting_bloom_filter m_filter;
+    bool m_filtering = false;
 };
 
 #endif